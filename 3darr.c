@@ -1,313 +1,1811 @@
+#define _GNU_SOURCE
+
+#include "lib3darr.h"
+#include "fixed_shapes.h"
+
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <linux/perf_event.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 /**
  * @file 3darr.c
  * Code comprising the `3darr` program.
  * Allocates a 3D array with dimensions specified by the arguments, populates it
- * with unique values, and prints it.
- * Unless specified otherwise, all functions have the implicit precondition of
- * all their arguments being defined. Unless specified otherwise, all functions
- * taking pointers have the implicit precondition that these pointers are valid,
- * and their pointees, if they are pointers, also satisfy the property the
- * argument itself satisfies. If an effect is not qualified by "may" or does not
- * express a mere possibility, it is guaranteed. A pointer/array being nul-terminated
- * implies it is a valid pointer.
+ * with unique values, and prints it, using `lib3darr`.
+ * The implicit preconditions stated in `lib3darr.c` apply here as well.
  */
 
-/**
- * Element of our array.
- * The fact that this is a unsigned long is relied on.
- */
-typedef unsigned long elem;
+/** Format of the allocation statistics report. */
+enum stats_mode {
+    /** No report. */
+    STATS_NONE,
+    /** Lines of text. */
+    STATS_TEXT,
+    /** One JSON object. */
+    STATS_JSON,
+};
+
+/** Command-line options. */
+struct opts {
+    /** Options of the array. */
+    struct arr3d_opts arr;
+    /** Output format. */
+    enum arr3d_format format;
+    /** Path of the file to write output to, or NULL for stdout. */
+    char *out;
+    /** File descriptor to write output to, set by `open_output`. */
+    int out_fd;
+    /** Whether to report timings of the phases of the program. */
+    bool bench;
+    /** Format of the allocation statistics report. */
+    enum stats_mode stats;
+    /** Whether to add hardware counters to the statistics report. */
+    bool perf;
+    /** Whether to limit storage to the available memory. */
+    bool check_mem;
+    /** Whether to only report the planned storage. */
+    bool dry_run;
+    /** Whether to use the precomputed output of fixed shapes. */
+    bool fixed;
+    /** Path of the directory to cache output in, or NULL. */
+    char *cache;
+    /** Path of the file to read batch requests from, `-` for stdin, or
+     * NULL. */
+    char *batch;
+    /** Path of the Unix socket to serve requests on, or NULL. */
+    char *listen;
+};
+
+/** Precomputed output of a fixed shape in one format. */
+struct fixed_output {
+    /** Bytes of the output, or NULL if not generated. */
+    const unsigned char *bytes;
+    /** Number of bytes of the output. */
+    size_t len;
+};
+
+/** Precomputed output named `name`. */
+#define FIXED_OUTPUT(name) {name, sizeof(name)}
+
+#if FIXED_HAS_NPY
+/** Precomputed `.npy` output of fixed shape, if supported. */
+#define FIXED_NPY(x, y, z) FIXED_OUTPUT(fixed_npy_##x##_##y##_##z)
+#else
+#define FIXED_NPY(x, y, z) {NULL, 0}
+#endif
 
 /**
  * Report number of successful allocations.
+ * @param stream stream to report to.
  * @param allocs number of allocations to report.
  *
  * @return if printing was successful.
  *
- * **Effects**: Prints to stdout, may print to stderr.
+ * **Effects**: Prints to `stream`, may print to stderr.
  */
-static bool print_allocs(size_t allocs) {
-    if (printf("successfully allocated %zu times\n", allocs) < 0) {
+static bool print_allocs(FILE *stream, size_t allocs) {
+    if (fprintf(stream, "successfully allocated %zu times\n", allocs) < 0) {
         perror("value output");
         return false;
     }
     return true;
 }
 
+/** Get stream to report allocations to.
+ *
+ * @param opts options selecting the output format, compression and file.
+ *
+ * @return stdout for uncompressed text output or output to a file, stderr for
+ * binary or compressed output to stdout, which must not be mixed with text.
+ */
+static FILE *report_stream(const struct opts *opts) {
+    return (opts->format == ARR3D_FORMAT_TEXT &&
+            opts->arr.compression == ARR3D_COMPRESSION_NONE) ||
+                   opts->out != NULL
+               ? stdout
+               : stderr;
+}
+
+/** Size of a buffer for an argument error message. */
+#define ARG_ERROR_LEN 128
+
 /**
  * Parse argument to `size_t`.
  *
  * @param arg argument string to be processed.
  * @param name argument name to be printed.
+ * @param[out] val pointer to store the parsed argument.
+ * @param[out] err buffer of `ARG_ERROR_LEN` bytes to store an error message
+ * in, ending with a newline.
  *
- * @return parsed argument as `size_t`.
+ * @return if `arg` could be parsed.
  *
  * @pre
  * - `arg` is nul-terminated.
  * - `name` is nul-terminated.
  *
- * **Effects**: may exit program, may print to stderr.
+ * **Effects**: writes `*val` on success, writes `err` on failure.
  */
-static size_t get_arg_size_t(char *arg, char *name) {
+static bool parse_size_t(char *arg, char *name, size_t *val, char *err) {
     char *argptrcpy = arg;
     while (isspace(*argptrcpy))
         argptrcpy++;
     if (*argptrcpy == '-') {
-        fprintf(stderr, "argument %s must be positive\n", name);
-        exit(EXIT_FAILURE);
+        snprintf(err, ARG_ERROR_LEN, "argument %s must be positive\n", name);
+        return false;
     }
     char *endptr;
     errno = 0;
-    uintmax_t val = strtoumax(arg, &endptr, 10);
+    uintmax_t v = strtoumax(arg, &endptr, 10);
     if (arg[0] == '\0' || *endptr != '\0') {
-        fprintf(stderr, "failed to parse argument %s\n", name);
-        exit(EXIT_FAILURE);
+        snprintf(err, ARG_ERROR_LEN, "failed to parse argument %s\n", name);
+        return false;
+    }
+    if (errno == ERANGE || v > SIZE_MAX) {
+        snprintf(err, ARG_ERROR_LEN, "argument %s is too large\n", name);
+        return false;
     }
-    if (errno == ERANGE || val > SIZE_MAX) {
-        fprintf(stderr, "argument %s is too large\n", name);
+    *val = (size_t)v;
+    return true;
+}
+
+/**
+ * Parse argument to `size_t`, or exit.
+ *
+ * @param arg argument string to be processed.
+ * @param name argument name to be printed.
+ *
+ * @return parsed argument as `size_t`.
+ *
+ * @pre
+ * - `arg` is nul-terminated.
+ * - `name` is nul-terminated.
+ *
+ * **Effects**: may exit program, may print to stderr.
+ */
+static size_t get_arg_size_t(char *arg, char *name) {
+    size_t val;
+    char err[ARG_ERROR_LEN];
+    if (!parse_size_t(arg, name, &val, err)) {
+        fputs(err, stderr);
         exit(EXIT_FAILURE);
     }
-    return (size_t)val;
+    return val;
 }
 
-/** Free subarrays up to excluding arr[i].
+/**
+ * Parse argument to range of indices.
+ *
+ * Accepts a size `n`, selecting `0:n`, or `start:stop` or `start:stop:step`,
+ * where an empty `start` is 0 and an empty `step` is 1.
  *
- * @param arr array to free.
- * @param i index of latest element of `arr` for which allocation has begun,
- * or the size of `arr` if allocation is finished.
- * @param y size of elements of `arr`.
+ * @param arg argument string to be processed, split in place at colons.
+ * @param name argument name to be printed.
+ * @param[out] range pointer to store the parsed range.
+ * @param[out] err buffer of `ARG_ERROR_LEN` bytes to store an error message
+ * in, ending with a newline.
+ *
+ * @return if `arg` could be parsed.
  *
  * @pre
- * - (1) for all `i_ < i`, `arr[i_]` is defined and allocated.
- * - (2) for all `i_ < i`, `j < y`, `arr[i_][j]` is defined and allocated.
+ * - `arg` is nul-terminated.
+ * - `name` is nul-terminated.
+ *
+ * **Effects**: writes `arg`, writes `*range` on success, writes `err` on
+ * failure.
+ *
+ * @post
+ * on success, the step of the range is at least 1.
+ */
+static bool parse_range(char *arg, char *name, struct arr3d_range *range,
+                        char *err) {
+    char *stop = strchr(arg, ':');
+    if (stop == NULL) {
+        range->start = 0;
+        range->step = 1;
+        return parse_size_t(arg, name, &range->stop, err);
+    }
+    *stop++ = '\0';
+    char *step = strchr(stop, ':');
+    if (step != NULL)
+        *step++ = '\0';
+    if (*stop == '\0') {
+        snprintf(err, ARG_ERROR_LEN, "argument %s needs an end\n", name);
+        return false;
+    }
+    range->start = 0;
+    range->step = 1;
+    if ((*arg != '\0' && !parse_size_t(arg, name, &range->start, err)) ||
+        !parse_size_t(stop, name, &range->stop, err) ||
+        (step != NULL && *step != '\0' &&
+         !parse_size_t(step, name, &range->step, err)))
+        return false;
+    if (range->step == 0) {
+        snprintf(err, ARG_ERROR_LEN, "step of argument %s must be at least 1\n",
+                 name);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Parse argument to range of indices, or exit.
+ *
+ * @param arg argument string to be processed, split in place at colons.
+ * @param name argument name to be printed.
+ *
+ * @return parsed range, as described at `parse_range`.
  *
- * **Correctness conditions**
- * - in (1), these are the only such `i_`.
- * - in (2), these are the only such `i_`, `j`.
+ * @pre
+ * - `arg` is nul-terminated.
+ * - `name` is nul-terminated.
  *
- * **Frees**
- * - `arr[i_]` for `i_` in (1).
- * - `arr[i_][j]` for `i_`, `j` in (2).
+ * **Effects**: writes `arg`, may exit program, may print to stderr.
  *
- * Effects: frees some pointers derived from `arr`.
+ * @post
+ * the step of the range is at least 1.
  */
-static void free_sub_arr_up_to(elem ***arr, size_t i, size_t y) {
-    for (size_t i_ = 0; i_ < i; i_++) {
-        for (size_t j = 0; j < y; j++)
-            free(arr[i_][j]);
-        free(arr[i_]);
+static struct arr3d_range get_arg_range(char *arg, char *name) {
+    struct arr3d_range range;
+    char err[ARG_ERROR_LEN];
+    if (!parse_range(arg, name, &range, err)) {
+        fputs(err, stderr);
+        exit(EXIT_FAILURE);
     }
+    return range;
 }
 
-/** Free completely allocated array.
+/** Print usage and exit.
  *
- * @param arr array to free.
- * @param x size of `arr`.
- * @param y size of elements of `arr`.
+ * @param argc argument count.
+ * @param argv_0 first argument string (usually the program name).
  *
  * @pre
- * - (1) for all `i < x`, `arr[i]` is defined and allocated.
- * - (2) for all `i < x`, `j < y, arr[i][j]` is defined and allocated.
- * - `arr` is allocated.
+ * - only if `argc == 0`, `argv_0` may be undefined.
+ * - `argv_0`, if defined, is nul-terminated.
  *
- * **Correctness conditions**
- * - in (1), these are the only such `i`.
- * - in (2), these are the only such `i`, `j`.
+ * **Effects**: prints to stderr, exits program.
+ */
+static void exit_usage(int argc, char *argv_0) {
+    char *pname = argc == 0 || argv_0[0] == '\0' ? "<program>" : argv_0;
+    fprintf(stderr,
+            "wrong usage!\n"
+            "usage: %s [options] <x> <y> <z>\n"
+            "       %s [options] --batch[=FILE] | --listen PATH\n"
+            "each of <x> <y> <z> is a size n, or a range start:stop[:step]\n"
+            "of the indices to select, where start is 0 and step 1 if empty\n"
+            "options:\n"
+            "  --layout=tree|flat|stream|lazy\n"
+            "                      storage layout of the array, none, or\n"
+            "                      tables of powers to compute it from\n"
+            "  --views             build row pointers into a flat array\n"
+            "  --backing=malloc|aligned|huge\n"
+            "                      allocate a flat array or arena with malloc,\n"
+            "                      page aligned, or on huge pages if possible\n"
+            "  --alloc=malloc|arena\n"
+            "                      allocate a tree with malloc per table and\n"
+            "                      row, or carve it out of one block\n"
+            "  -j, --jobs=N        populate and format the array with N threads\n"
+            "  --numa=none|interleave|local\n"
+            "                      leave placement to the kernel, interleave\n"
+            "                      the array across NUMA nodes, or pin each\n"
+            "                      thread to the node of its part of it\n"
+            "  --format=text|raw|npy\n"
+            "                      output as text lines, raw little-endian\n"
+            "                      elements, or a NumPy .npy file\n"
+            "  --out FILE          write output to FILE; binary output is\n"
+            "                      built in place in a mapping of FILE\n"
+            "  --wrap              allow values to wrap around instead of\n"
+            "                      failing when they exceed the element type\n"
+            "  --bench             report timings of each phase to stderr\n"
+            "  --stats[=text|json] report allocation statistics, cycles and\n"
+            "                      page faults to stderr\n"
+            "  --perf              add cycles, instructions and cache misses\n"
+            "                      of the hardware counters to the report\n"
+            "  --check-mem         fail up front if the array exceeds the\n"
+            "                      available memory or cgroup limit\n"
+            "  --dry-run           report the planned storage and exit\n"
+            "  --splice            splice the pages of output buffers into a\n"
+            "                      pipe instead of copying, if it is read\n"
+            "  --compress=zstd|lz4 compress output as independent frames,\n"
+            "                      one per chunk, with the formatting threads\n"
+            "  --compress-level=N  compression level, or 0 for the default\n"
+            "  --no-fixed          format fixed shapes like any other instead\n"
+            "                      of writing their precomputed output\n"
+            "  --cache DIR         reuse output cached in DIR by earlier runs\n"
+            "                      with the same selection and output options\n"
+            "  --batch[=FILE]      answer requests of lines <x> <y> <z> from\n"
+            "                      stdin or FILE, reusing the array handle\n"
+            "  --listen PATH       answer requests of connections to the Unix\n"
+            "                      socket PATH, one connection at a time\n",
+            pname, pname);
+    exit(EXIT_FAILURE);
+}
+
+/** Check argument count, correct user, and exit.
  *
- * **Frees**
- * - `arr[i]` for `i` in (1).
- * - `arr[i][j]` for `i`, `j` in (2).
+ * @param argc argument count.
+ * @param argi index of the first positional argument.
+ * @param argv_0 first argument string (usually the program name).
+ *
+ * @pre
+ * - only if `argc == 0`, `argv_0` may be undefined.
+ * - `argv_0`, if defined, is nul-terminated.
+ *
+ * **Effects**: may print to stderr, may exit program.
  *
- * **Effects**: frees arr and all valid pointers derived from it.
+ * @post
+ * `argc - argi == 3`
  */
-static void free_complete_arr(elem ***arr, size_t x, size_t y) {
-    free_sub_arr_up_to(arr, x, y);
-    free(arr);
+static void ensure_usage(int argc, int argi, char *argv_0) {
+    if (argc - argi != 3)
+        exit_usage(argc, argv_0);
 }
 
-/** Free incomplete array.
+/** Match option of the form `--name=value`.
+ *
+ * @param arg argument string to be matched.
+ * @param name option name including the leading dashes.
  *
- * @param arr array to free.
- * @param y size of elements of arr.
- * @param i index of latest element of arr for which allocation has begun.
- * @param j index of latest element of `arr[i]` for which allocation has
- * begun, or y if allocation of that subarray is finished.
+ * @return pointer to the value in `arg`, or NULL if `arg` does not match.
  *
  * @pre
- * - (1) for all `i_ < i`, `arr[i_]` is defined and allocated.
- * - (2) for all `i_ < i`, `j_ < y`, `arr[i_][j_]` is defined and allocated.
- * - (3) for all `j_ < j`, `arr[i][j_]` is defined and allocated.
- * - `arr` is allocated.
- *
- * **Correctness conditions**
- * - in (1), these are the only such `i_`.
- * - in (2), these are the only such `i_`, `j_`.
- * - in (3), these are the only such `j_`.
- *
- * **Frees**
- * - `arr`
- * - `arr[i_]` for `i_` in (1).
- * - `arr[i_][j_]` for `i_`, `j_` in (2).
- * - `arr[i][j_]` for `j_` in (3).
- *
- * **Effects**: frees `arr` and all valid pointers derived from it.
- */
-static void free_incomplete_arr(elem ***arr, size_t y, size_t i, size_t j) {
-    free_sub_arr_up_to(arr, i, y);
-    for (size_t j_ = 0; j_ < j; j_++)
-        free(arr[i][j_]);
-    free(arr[i]);
-    free(arr);
-}
-
-/** Calculate `x` to the `y`-th power using exponentiation by squaring.
- *
- * @param x base of exponentiation.
- * @param y exponent.
- */
-static elem elem_pow(elem x, size_t y) {
-    elem result = 1;
-    while (true) {
-        if ((y & 1) == 1)
-            result *= x;
-        y >>= 1;
-        if (y == 0)
-            break;
-        x *= x;
-    }
-    return result;
+ * - `arg` is nul-terminated.
+ * - `name` is nul-terminated.
+ */
+static char *match_opt(char *arg, char *name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+        return NULL;
+    return arg + len + 1;
 }
 
-/** Allocate and initialize 3D array.
+/** Parse leading options.
  *
- * @param x desired size of first layer of array.
- * @param y desired size of each second layer of array.
- * @param z desired size of each third layer of array.
- * @param[out] allocs pointer to store allocation count.
+ * Options end at the first argument not starting with `-`, at an argument
+ * that looks like a negative number, or after `--`.
  *
- * **Effects**: allocates, writes *allocs, may print to stderr, may exit
- * program.
+ * @param argc argument count.
+ * @param argv argument vector.
+ * @param[out] opts options to store.
  *
- * @post
- * for all `i < x`, `j < y`, `k < z`, `x[i][j][k]` is defined, where `x` is the
- * return value.
- */
-static elem ***mk_arr(size_t x, size_t y, size_t z, size_t *allocs) {
-    *allocs = 0;
-    elem ***arr = malloc(x * sizeof(elem **));
-    if (arr == NULL) {
-        perror("array allocation");
-        print_allocs(*allocs);
-        exit(EXIT_FAILURE);
-    }
-    ++*allocs;
-    for (size_t i = 0; i < x; i++) {
-        arr[i] = malloc(y * sizeof(elem *));
-        if (arr[i] == NULL) {
-            perror("array allocation");
-            print_allocs(*allocs);
-            free_incomplete_arr(arr, y, i, 0);
-            exit(EXIT_FAILURE);
+ * @return index of the first positional argument.
+ *
+ * @pre
+ * `argv[i]` is nul-terminated for all `i < argc`.
+ *
+ * **Effects**: writes `*opts`, may print to stderr, may exit program.
+ */
+static int parse_opts(int argc, char **argv, struct opts *opts) {
+    opts->arr.layout = ARR3D_LAYOUT_TREE;
+    opts->arr.views = false;
+    opts->arr.backing = ARR3D_BACKING_MALLOC;
+    opts->arr.tree_alloc = ARR3D_TREE_ALLOC_MALLOC;
+    opts->arr.jobs = 1;
+    opts->arr.numa = ARR3D_NUMA_NONE;
+    opts->format = ARR3D_FORMAT_TEXT;
+    opts->out = NULL;
+    opts->out_fd = STDOUT_FILENO;
+    opts->arr.wrap = false;
+    opts->arr.map_fd = -1;
+    opts->arr.map_format = ARR3D_FORMAT_RAW;
+    opts->bench = false;
+    opts->stats = STATS_NONE;
+    opts->perf = false;
+    opts->arr.time_allocs = false;
+    opts->arr.count_cycles = false;
+    opts->arr.mem_limit = 0;
+    opts->arr.splice = false;
+    opts->arr.compression = ARR3D_COMPRESSION_NONE;
+    opts->arr.compression_level = 0;
+    opts->check_mem = false;
+    opts->dry_run = false;
+    opts->fixed = true;
+    opts->cache = NULL;
+    opts->batch = NULL;
+    opts->listen = NULL;
+    int argi = 1;
+    for (; argi < argc; argi++) {
+        char *arg = argv[argi];
+        char *val;
+        if (arg[0] != '-' || isdigit((unsigned char)arg[1]))
+            break;
+        if (strcmp(arg, "--") == 0) {
+            argi++;
+            break;
         }
-        ++*allocs;
-        for (size_t j = 0; j < y; j++) {
-            arr[i][j] = malloc(z * sizeof(elem));
-            if (arr[i][j] == NULL) {
-                perror("array allocation");
-                print_allocs(*allocs);
-                free_incomplete_arr(arr, y, i, j);
+        if ((val = match_opt(arg, "--layout")) != NULL) {
+            if (strcmp(val, "tree") == 0)
+                opts->arr.layout = ARR3D_LAYOUT_TREE;
+            else if (strcmp(val, "flat") == 0)
+                opts->arr.layout = ARR3D_LAYOUT_FLAT;
+            else if (strcmp(val, "stream") == 0)
+                opts->arr.layout = ARR3D_LAYOUT_STREAM;
+            else if (strcmp(val, "lazy") == 0)
+                opts->arr.layout = ARR3D_LAYOUT_LAZY;
+            else
+                exit_usage(argc, argv[0]);
+        } else if ((val = match_opt(arg, "--numa")) != NULL) {
+            if (strcmp(val, "none") == 0)
+                opts->arr.numa = ARR3D_NUMA_NONE;
+            else if (strcmp(val, "interleave") == 0)
+                opts->arr.numa = ARR3D_NUMA_INTERLEAVE;
+            else if (strcmp(val, "local") == 0)
+                opts->arr.numa = ARR3D_NUMA_LOCAL;
+            else
+                exit_usage(argc, argv[0]);
+        } else if ((val = match_opt(arg, "--format")) != NULL) {
+            if (strcmp(val, "text") == 0)
+                opts->format = ARR3D_FORMAT_TEXT;
+            else if (strcmp(val, "raw") == 0)
+                opts->format = ARR3D_FORMAT_RAW;
+            else if (strcmp(val, "npy") == 0)
+                opts->format = ARR3D_FORMAT_NPY;
+            else
+                exit_usage(argc, argv[0]);
+        } else if (strcmp(arg, "--out") == 0 ||
+                   (val = match_opt(arg, "--out")) != NULL) {
+            if (val == NULL && ++argi == argc)
+                exit_usage(argc, argv[0]);
+            opts->out = val == NULL ? argv[argi] : val;
+        } else if (strcmp(arg, "--cache") == 0 ||
+                   (val = match_opt(arg, "--cache")) != NULL) {
+            if (val == NULL && ++argi == argc)
+                exit_usage(argc, argv[0]);
+            opts->cache = val == NULL ? argv[argi] : val;
+        } else if (strcmp(arg, "--batch") == 0 ||
+                   (val = match_opt(arg, "--batch")) != NULL) {
+            opts->batch = val == NULL ? "-" : val;
+        } else if (strcmp(arg, "--listen") == 0 ||
+                   (val = match_opt(arg, "--listen")) != NULL) {
+            if (val == NULL && ++argi == argc)
+                exit_usage(argc, argv[0]);
+            opts->listen = val == NULL ? argv[argi] : val;
+        } else if (strcmp(arg, "--bench") == 0) {
+            opts->bench = true;
+        } else if (strcmp(arg, "--stats") == 0 ||
+                   (val = match_opt(arg, "--stats")) != NULL) {
+            if (val == NULL || strcmp(val, "text") == 0)
+                opts->stats = STATS_TEXT;
+            else if (strcmp(val, "json") == 0)
+                opts->stats = STATS_JSON;
+            else
+                exit_usage(argc, argv[0]);
+            opts->arr.time_allocs = true;
+            opts->arr.count_cycles = true;
+        } else if (strcmp(arg, "--perf") == 0) {
+            opts->perf = true;
+        } else if ((val = match_opt(arg, "--compress")) != NULL) {
+            if (strcmp(val, "zstd") == 0)
+                opts->arr.compression = ARR3D_COMPRESSION_ZSTD;
+            else if (strcmp(val, "lz4") == 0)
+                opts->arr.compression = ARR3D_COMPRESSION_LZ4;
+            else
+                exit_usage(argc, argv[0]);
+        } else if ((val = match_opt(arg, "--compress-level")) != NULL) {
+            size_t level = get_arg_size_t(val, "compress-level");
+            if (level > INT_MAX) {
+                fprintf(stderr, "argument compress-level is too large\n");
                 exit(EXIT_FAILURE);
             }
-            ++*allocs;
-            for (size_t k = 0; k < z; k++)
-                // First three prime numbers
-                arr[i][j][k] = elem_pow(2, i) * elem_pow(3, j) * elem_pow(5, k);
+            opts->arr.compression_level = (int)level;
+        } else if (strcmp(arg, "--no-fixed") == 0) {
+            opts->fixed = false;
+        } else if (strcmp(arg, "--splice") == 0) {
+            opts->arr.splice = true;
+        } else if (strcmp(arg, "--check-mem") == 0) {
+            opts->check_mem = true;
+        } else if (strcmp(arg, "--dry-run") == 0) {
+            opts->dry_run = true;
+        } else if (strcmp(arg, "--wrap") == 0) {
+            opts->arr.wrap = true;
+        } else if ((val = match_opt(arg, "--backing")) != NULL) {
+            if (strcmp(val, "malloc") == 0)
+                opts->arr.backing = ARR3D_BACKING_MALLOC;
+            else if (strcmp(val, "aligned") == 0)
+                opts->arr.backing = ARR3D_BACKING_ALIGNED;
+            else if (strcmp(val, "huge") == 0)
+                opts->arr.backing = ARR3D_BACKING_HUGE;
+            else
+                exit_usage(argc, argv[0]);
+        } else if ((val = match_opt(arg, "--alloc")) != NULL) {
+            if (strcmp(val, "malloc") == 0)
+                opts->arr.tree_alloc = ARR3D_TREE_ALLOC_MALLOC;
+            else if (strcmp(val, "arena") == 0)
+                opts->arr.tree_alloc = ARR3D_TREE_ALLOC_ARENA;
+            else
+                exit_usage(argc, argv[0]);
+        } else if (strcmp(arg, "--views") == 0) {
+            opts->arr.views = true;
+        } else if (strcmp(arg, "-j") == 0 ||
+                   (val = match_opt(arg, "--jobs")) != NULL) {
+            if (val == NULL && ++argi == argc)
+                exit_usage(argc, argv[0]);
+            opts->arr.jobs = get_arg_size_t(val == NULL ? argv[argi] : val, "jobs");
+            if (opts->arr.jobs == 0) {
+                fprintf(stderr, "argument jobs must be at least 1\n");
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            exit_usage(argc, argv[0]);
         }
     }
-    return arr;
+    // Hardware counters are reported with the statistics
+    if (opts->perf && opts->stats == STATS_NONE) {
+        opts->stats = STATS_TEXT;
+        opts->arr.time_allocs = true;
+        opts->arr.count_cycles = true;
+    }
+    return argi;
 }
 
-/** Check argument count, correct user, and exit.
+/** Check if output is built in place in a mapping of the output file.
  *
- * @param argc argument count.
- * @param argv_0 first argument string (usually the program name).
+ * @param opts options selecting the output format, compression, cache, file
+ * and storage layout.
+ *
+ * @return if the output is binary, uncompressed, not cached and to a file,
+ * and the array is stored.
+ */
+static bool maps_output(const struct opts *opts) {
+    return opts->out != NULL && opts->format != ARR3D_FORMAT_TEXT &&
+           opts->arr.compression == ARR3D_COMPRESSION_NONE &&
+           opts->cache == NULL &&
+           opts->arr.layout != ARR3D_LAYOUT_STREAM &&
+           opts->arr.layout != ARR3D_LAYOUT_LAZY;
+}
+
+/** Find precomputed output of fixed shape.
+ *
+ * The shapes are those of `FIXED_SHAPES` in `fixed_shapes.h`, generated by
+ * `gen_fixed` from the `FIXED_SHAPES` setting of the Makefile.
+ *
+ * @param box selected indices of each dimension.
+ * @param format output format.
+ * @param[out] out pointer to store the output.
+ *
+ * @return if `box` selects a whole array of a fixed shape whose output in
+ * `format` was generated.
+ *
+ * **Effects**: may write `*out`.
+ */
+static bool find_fixed(const struct arr3d_range box[3],
+                       enum arr3d_format format, struct fixed_output *out) {
+    if (box[0].start != 0 || box[0].step != 1 || box[1].start != 0 ||
+        box[1].step != 1 || box[2].start != 0 || box[2].step != 1)
+        return false;
+    // Unused without fixed shapes
+    (void)format;
+    (void)out;
+#define X(x, y, z)                                                             \
+    if (box[0].stop == x && box[1].stop == y && box[2].stop == z) {            \
+        const struct fixed_output outs[] = {                                   \
+            [ARR3D_FORMAT_TEXT] = FIXED_OUTPUT(fixed_text_##x##_##y##_##z),    \
+            [ARR3D_FORMAT_RAW] = FIXED_OUTPUT(fixed_raw_##x##_##y##_##z),      \
+            [ARR3D_FORMAT_NPY] = FIXED_NPY(x, y, z),                           \
+        };                                                                     \
+        *out = outs[format];                                                   \
+        return out->bytes != NULL;                                             \
+    }
+    FIXED_SHAPES
+#undef X
+    return false;
+}
+
+/** Plan array instead of populating it, since its output is at hand.
+ *
+ * @param arr array to plan.
+ * @param mem_limit limit on the number of bytes, or 0.
+ * @param[out] allocs pointer to store the number of allocations that
+ * populating the array would make.
+ *
+ * @return `ARR3D_OK`, `ARR3D_SIZE`, or `ARR3D_MEMORY` if the storage exceeds
+ * `mem_limit`, like `arr3d_fill`.
+ *
+ * **Effects**: writes `*allocs` on success, may write `errno`.
+ */
+static enum arr3d_status plan_only(const struct arr3d *arr, size_t mem_limit,
+                                   size_t *allocs) {
+    struct arr3d_stats plan;
+    size_t bytes;
+    enum arr3d_status status = arr3d_plan(arr, &plan, &bytes);
+    if (status != ARR3D_OK)
+        return status;
+    if (mem_limit > 0 && bytes > mem_limit) {
+        errno = ENOMEM;
+        return ARR3D_MEMORY;
+    }
+    *allocs = plan.allocs;
+    return ARR3D_OK;
+}
+
+/** Write precomputed output of a fixed shape.
+ *
+ * @param fixed output to write.
+ * @param fd file descriptor to write to.
+ * @param[out] written pointer to store the number of bytes written.
+ *
+ * @return `ARR3D_OK` or `ARR3D_OUTPUT`.
+ *
+ * **Effects**: writes to `fd`, writes `*written` on success, may write
+ * `errno`.
+ */
+static enum arr3d_status write_fixed(const struct fixed_output *fixed, int fd,
+                                     size_t *written) {
+    for (size_t done = 0; done < fixed->len;) {
+        ssize_t n = write(fd, fixed->bytes + done, fixed->len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return ARR3D_OUTPUT;
+        done += (size_t)n;
+    }
+    *written = fixed->len;
+    return ARR3D_OK;
+}
+
+/** Magic bytes at the start of a cache entry, versioning its layout. */
+#define CACHE_MAGIC "3darr\0c1"
+
+/** Maximal length of the key of a cache entry, including the nul. */
+#define CACHE_KEY_LEN 256
+
+/**
+ * Header of a cache entry, followed by `len` bytes of output.
+ *
+ * Entries are only valid on the host that wrote them, since the header is
+ * stored in host byte order, like the key records the element size.
+ */
+struct cache_header {
+    /** `CACHE_MAGIC`. */
+    char magic[8];
+    /** Description of everything the output depends on, nul-padded. */
+    char key[CACHE_KEY_LEN];
+    /** Number of bytes of output. */
+    uint64_t len;
+    /** Checksum of the output, computed by `checksum`. */
+    uint64_t sum;
+};
+
+/** Entry of the output cache. */
+struct cache_entry {
+    /** Header of the entry, with `magic` and `key` always defined. */
+    struct cache_header header;
+    /** Path of the entry, named after a hash of `header.key`. */
+    char *path;
+    /** Path of the temporary file written on a miss, or NULL on a hit. */
+    char *tmp_path;
+    /** File descriptor of the entry on a hit, or of `tmp_path`. */
+    int fd;
+};
+
+/** Hash bytes like FNV-1a, but eight bytes at a time.
+ *
+ * Each step also folds the high half of the hash into the low half, since
+ * the multiplication only carries bits upwards.
+ *
+ * @param h hash of the preceding bytes, or the FNV offset basis.
+ * @param data bytes to hash.
+ * @param len number of bytes.
+ *
+ * @return hash of the preceding bytes and `data`.
+ */
+static uint64_t checksum(uint64_t h, const unsigned char *data, size_t len) {
+    const uint64_t prime = 0x100000001b3;
+    size_t i = 0;
+    for (; len - i >= sizeof(uint64_t); i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * prime;
+        h ^= h >> 32;
+    }
+    for (; i < len; i++)
+        h = (h ^ data[i]) * prime;
+    h ^= h >> 32;
+    return h;
+}
+
+/** FNV-1a offset basis, the checksum of no bytes. */
+#define CHECKSUM_INIT ((uint64_t)0xcbf29ce484222325)
+
+/** Compute checksum of the output in a cache file.
+ *
+ * @param fd file descriptor of the cache file.
+ * @param len number of bytes of output after the header.
+ * @param[out] sum pointer to store the checksum.
+ *
+ * @return if the file could be mapped, otherwise `errno` is set.
+ *
+ * **Effects**: maps `fd`, writes `*sum`, may write `errno`.
+ */
+static bool checksum_file(int fd, size_t len, uint64_t *sum) {
+    size_t map_len = sizeof(struct cache_header) + len;
+    const unsigned char *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    *sum = checksum(CHECKSUM_INIT, map + sizeof(struct cache_header), len);
+    munmap((void *)map, map_len);
+    return true;
+}
+
+/** Check if cache file holds an intact entry.
+ *
+ * Partially written or otherwise damaged entries fail either the length or
+ * the checksum, and entries of other keys with the same hash fail the key.
+ *
+ * @param fd file descriptor of the cache file.
+ * @param[in,out] header header whose `magic` and `key` the entry must have,
+ * and whose `len` and `sum` to write.
+ *
+ * @return if the entry is intact.
+ *
+ * **Effects**: reads and maps `fd`, may write `*header` and `errno`.
+ */
+static bool check_cache_file(int fd, struct cache_header *header) {
+    struct cache_header found;
+    struct stat st;
+    if (pread(fd, &found, sizeof(found), 0) != (ssize_t)sizeof(found) ||
+        memcmp(found.magic, header->magic, sizeof(found.magic)) != 0 ||
+        memcmp(found.key, header->key, sizeof(found.key)) != 0 ||
+        fstat(fd, &st) != 0 || found.len > SIZE_MAX - sizeof(found) ||
+        (uintmax_t)st.st_size != sizeof(found) + found.len)
+        return false;
+    uint64_t sum;
+    if (!checksum_file(fd, (size_t)found.len, &sum) || sum != found.sum)
+        return false;
+    *header = found;
+    return true;
+}
+
+/** Look up output in the cache, or prepare to add it.
+ *
+ * The key covers the selected indices, the output format and compression,
+ * and the element size, on which the output depends. On a miss, a new
+ * entry is written to a temporary file in the cache directory, to be moved
+ * into place by `commit_cache`, so that readers never see it incomplete.
+ *
+ * @param opts options selecting the cache directory and output.
+ * @param box selected indices of each dimension.
+ * @param[out] entry entry to initialize.
+ *
+ * @return if the entry was found intact.
  *
  * @pre
- * - only if `argc == 0`, `argv_0` may be undefined.
- * - `argv_0`, if defined, is nul-terminated.
+ * `opts->cache` is not NULL.
  *
- * **Effects**: may print to stderr, may exit program.
+ * **Effects**: allocates, opens files, writes `*entry`, may create a file,
+ * may print to stderr, may exit program.
+ */
+static bool open_cache(const struct opts *opts,
+                       const struct arr3d_range box[3],
+                       struct cache_entry *entry) {
+    struct cache_header *header = &entry->header;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+    int len = snprintf(
+        header->key, sizeof(header->key),
+        "elem %zu format %d compression %d level %d box "
+        "%zu:%zu:%zu %zu:%zu:%zu %zu:%zu:%zu",
+        sizeof(elem), (int)opts->format, (int)opts->arr.compression,
+        opts->arr.compression_level, box[0].start, box[0].stop, box[0].step,
+        box[1].start, box[1].stop, box[1].step, box[2].start, box[2].stop,
+        box[2].step);
+    uint64_t hash = checksum(CHECKSUM_INIT, (unsigned char *)header->key,
+                             sizeof(header->key));
+    entry->tmp_path = NULL;
+    if (len < 0 || (size_t)len >= sizeof(header->key) ||
+        asprintf(&entry->path, "%s/3darr-%016" PRIx64, opts->cache, hash) <
+            0) {
+        perror("cache");
+        exit(EXIT_FAILURE);
+    }
+    entry->fd = open(entry->path, O_RDONLY);
+    if (entry->fd >= 0) {
+        if (check_cache_file(entry->fd, header))
+            return true;
+        close(entry->fd);
+    }
+    if (asprintf(&entry->tmp_path, "%s/.3darr-XXXXXX", opts->cache) < 0 ||
+        (entry->fd = mkstemp(entry->tmp_path)) < 0 ||
+        lseek(entry->fd, sizeof(*header), SEEK_SET) < 0) {
+        perror("cache");
+        exit(EXIT_FAILURE);
+    }
+    return false;
+}
+
+/** Complete new cache entry and move it into place.
  *
- * @post
- * `i == 4`
+ * @param entry entry prepared by `open_cache`, whose temporary file holds the
+ * output after the header.
+ * @param len number of bytes of output.
+ *
+ * @return if the entry could be completed, otherwise `errno` is set.
+ *
+ * **Effects**: maps and writes `entry->fd`, writes `entry->header`, renames
+ * `entry->tmp_path`, may write `errno`.
+ */
+static bool commit_cache(struct cache_entry *entry, size_t len) {
+    struct cache_header *header = &entry->header;
+    header->len = len;
+    if (!checksum_file(entry->fd, len, &header->sum) ||
+        pwrite(entry->fd, header, sizeof(*header), 0) !=
+            (ssize_t)sizeof(*header) ||
+        rename(entry->tmp_path, entry->path) != 0)
+        return false;
+    free(entry->tmp_path);
+    entry->tmp_path = NULL;
+    return true;
+}
+
+/** Write output of cache entry.
+ *
+ * The output is sent with `sendfile`, or copied from a mapping if the output
+ * file does not support that.
+ *
+ * @param entry entry holding intact output.
+ * @param fd file descriptor to write to.
+ * @param[out] written pointer to store the number of bytes written.
+ *
+ * @return `ARR3D_OK` or `ARR3D_OUTPUT`.
+ *
+ * **Effects**: reads `entry->fd`, writes to `fd`, writes `*written` on
+ * success, may write `errno`.
+ */
+static enum arr3d_status send_cache(const struct cache_entry *entry, int fd,
+                                    size_t *written) {
+    size_t len = (size_t)entry->header.len;
+    off_t off = sizeof(entry->header);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = sendfile(fd, entry->fd, &off, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && done == 0 && (errno == EINVAL || errno == ENOSYS))
+            break;
+        if (n <= 0)
+            return ARR3D_OUTPUT;
+        done += (size_t)n;
+    }
+    if (done < len) {
+        size_t map_len = sizeof(entry->header) + len;
+        char *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, entry->fd, 0);
+        if (map == MAP_FAILED)
+            return ARR3D_OUTPUT;
+        struct fixed_output out = {(unsigned char *)map + off, len};
+        enum arr3d_status status = write_fixed(&out, fd, &done);
+        munmap(map, map_len);
+        if (status != ARR3D_OK)
+            return status;
+    }
+    *written = len;
+    return ARR3D_OK;
+}
+
+/** Format array into new cache entry, and write the output from there.
+ *
+ * If the entry cannot be completed, a warning is printed, and the output is
+ * still written.
+ *
+ * @param arr array to format.
+ * @param format output format.
+ * @param entry entry prepared by `open_cache` on a miss.
+ * @param fd file descriptor to write to.
+ * @param[out] written pointer to store the number of bytes written.
+ *
+ * @return `ARR3D_OK`, or a status of `arr3d_format` or `send_cache`.
+ *
+ * **Effects**: may allocate, writes to `entry->fd` and `fd`, writes
+ * `entry->header`, may rename `entry->tmp_path`, may create threads, may
+ * print to stderr, writes `*written` on success, may write `errno`.
  */
-static void ensure_usage(int argc, char *argv_0) {
-    if (argc != 4) {
-        char *pname = argc == 0 || argv_0[0] == '\0' ? "<program>" : argv_0;
+static enum arr3d_status format_cache(struct arr3d *arr,
+                                      enum arr3d_format format,
+                                      struct cache_entry *entry, int fd,
+                                      size_t *written) {
+    size_t len;
+    enum arr3d_status status = arr3d_format(arr, format, entry->fd, &len);
+    if (status != ARR3D_OK)
+        return status;
+    if (!commit_cache(entry, len))
+        perror("cache");
+    return send_cache(entry, fd, written);
+}
+
+/** Close cache entry, removing an uncommitted temporary file.
+ *
+ * @param entry entry to close.
+ *
+ * **Frees**: `entry->path`, `entry->tmp_path`.
+ *
+ * **Effects**: closes `entry->fd`, may remove `entry->tmp_path`.
+ */
+static void close_cache(struct cache_entry *entry) {
+    int err = errno;
+    close(entry->fd);
+    if (entry->tmp_path != NULL)
+        unlink(entry->tmp_path);
+    free(entry->tmp_path);
+    free(entry->path);
+    errno = err;
+}
+
+/** Point in time of a benchmark. */
+struct bench_clock {
+    /** Wall-clock time. */
+    struct timespec wall;
+    /** CPU time used by the process. */
+    struct timespec cpu;
+};
+
+/** Read benchmark clocks.
+ *
+ * @param[out] clock clocks to store.
+ *
+ * **Effects**: writes `*clock`.
+ */
+static void bench_now(struct bench_clock *clock) {
+    clock_gettime(CLOCK_MONOTONIC, &clock->wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &clock->cpu);
+}
+
+/** Get seconds between points in time.
+ *
+ * @param from earlier point in time.
+ * @param to later point in time.
+ *
+ * @return seconds from `from` to `to`.
+ */
+static double timespec_diff(const struct timespec *from,
+                            const struct timespec *to) {
+    return (double)(to->tv_sec - from->tv_sec) +
+           (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/** Report timings of a phase of the program and start the next one.
+ *
+ * @param name name of the phase.
+ * @param[in,out] start start of the phase, to be set to its end.
+ * @param bytes number of bytes output in the phase, or 0.
+ *
+ * **Effects**: writes `*start`, prints to stderr.
+ */
+static void bench_report(const char *name, struct bench_clock *start,
+                         size_t bytes) {
+    struct bench_clock end;
+    bench_now(&end);
+    double wall = timespec_diff(&start->wall, &end.wall);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "bench %s: wall %.6f s, cpu %.6f s, max rss %ld KiB", name,
+            wall, timespec_diff(&start->cpu, &end.cpu), usage.ru_maxrss);
+    if (bytes > 0)
+        fprintf(stderr, ", %zu bytes, %.1f MB/s", bytes,
+                wall > 0 ? (double)bytes / wall / 1e6 : 0.0);
+    fputc('\n', stderr);
+    *start = end;
+}
+
+/** Page fault counts of a phase of the program. */
+struct faults {
+    /** Minor page faults, served without I/O. */
+    long minor;
+    /** Major page faults, which required I/O. */
+    long major;
+};
+
+/** Count page faults since the start of a phase and start the next one.
+ *
+ * @param[in,out] start fault counts of the process at the start of the phase,
+ * to be set to those at its end.
+ * @param[out] phase pointer to store the faults of the phase.
+ *
+ * **Effects**: writes `*start`, writes `*phase`.
+ */
+static void count_faults(struct faults *start, struct faults *phase) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    phase->minor = usage.ru_minflt - start->minor;
+    phase->major = usage.ru_majflt - start->major;
+    start->minor = usage.ru_minflt;
+    start->major = usage.ru_majflt;
+}
+
+/** Hardware events counted with `--perf`. */
+enum perf_event {
+    /** CPU cycles. */
+    PERF_CYCLES,
+    /** Retired instructions. */
+    PERF_INSTRUCTIONS,
+    /** Last-level cache references. */
+    PERF_CACHE_REFS,
+    /** Last-level cache misses. */
+    PERF_CACHE_MISSES,
+    /** Number of events. */
+    PERF_NEVENTS,
+};
+
+/** Hardware counters of the process, including the threads it creates. */
+struct perf {
+    /** File descriptor of each counter, all -1 if any is unavailable. */
+    int fds[PERF_NEVENTS];
+};
+
+/** Hardware event counts of a phase of the program. */
+struct perf_counts {
+    /** Count of each event. */
+    uint64_t n[PERF_NEVENTS];
+};
+
+/** Open and enable hardware counters of user space.
+ *
+ * Counters are inherited by threads created later, whose counts are added
+ * to those of the process once they exit.
+ *
+ * @param[out] perf counters to open.
+ *
+ * @return if all counters could be opened.
+ *
+ * **Effects**: opens counters, writes `*perf`, may write `errno`.
+ */
+static bool perf_open(struct perf *perf) {
+    static const uint64_t configs[PERF_NEVENTS] = {
+        [PERF_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+        [PERF_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+        [PERF_CACHE_REFS] = PERF_COUNT_HW_CACHE_REFERENCES,
+        [PERF_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+    };
+    for (size_t e = 0; e < PERF_NEVENTS; e++) {
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof(attr),
+            .config = configs[e],
+            .inherit = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        perf->fds[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                                    PERF_FLAG_FD_CLOEXEC);
+        if (perf->fds[e] < 0) {
+            int err = errno;
+            for (size_t o = 0; o < e; o++)
+                close(perf->fds[o]);
+            for (size_t o = 0; o < PERF_NEVENTS; o++)
+                perf->fds[o] = -1;
+            errno = err;
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Count hardware events since the start of a phase and start the next one.
+ *
+ * @param perf counters, possibly unavailable.
+ * @param[in,out] start counts at the start of the phase, to be set to those
+ * at its end.
+ * @param[out] phase pointer to store the counts of the phase.
+ *
+ * **Effects**: reads the counters, writes `*start`, writes `*phase`.
+ */
+static void count_perf(const struct perf *perf, struct perf_counts *start,
+                       struct perf_counts *phase) {
+    for (size_t e = 0; e < PERF_NEVENTS; e++) {
+        uint64_t n = 0;
+        if (perf->fds[e] >= 0 &&
+            read(perf->fds[e], &n, sizeof(n)) != (ssize_t)sizeof(n))
+            n = start->n[e];
+        phase->n[e] = n - start->n[e];
+        start->n[e] = n;
+    }
+}
+
+/** Close hardware counters.
+ *
+ * @param perf counters, possibly unavailable.
+ *
+ * **Effects**: closes the counters.
+ */
+static void perf_close(const struct perf *perf) {
+    for (size_t e = 0; e < PERF_NEVENTS; e++)
+        if (perf->fds[e] >= 0)
+            close(perf->fds[e]);
+}
+
+/** Report hardware event counts of a phase as text.
+ *
+ * @param name name of the phase.
+ * @param counts event counts of the phase.
+ *
+ * **Effects**: prints to stderr.
+ */
+static void report_perf(const char *name, const struct perf_counts *counts) {
+    const uint64_t *n = counts->n;
+    fprintf(stderr,
+            "stats perf %s: %" PRIu64 " cycles, %" PRIu64
+            " instructions, %.2f IPC, %" PRIu64 " of %" PRIu64
+            " cache references missed\n",
+            name, n[PERF_CYCLES], n[PERF_INSTRUCTIONS],
+            n[PERF_CYCLES] > 0
+                ? (double)n[PERF_INSTRUCTIONS] / (double)n[PERF_CYCLES]
+                : 0.0,
+            n[PERF_CACHE_MISSES], n[PERF_CACHE_REFS]);
+}
+
+/** Report allocation statistics, cycles and page faults to stderr.
+ *
+ * @param mode format of the report.
+ * @param stats allocation statistics of the array.
+ * @param fill page faults while populating the array.
+ * @param format page faults while formatting the array.
+ * @param fill_perf hardware event counts while populating the array, or
+ * NULL if not counted.
+ * @param format_perf hardware event counts while formatting the array, or
+ * NULL if not counted.
+ *
+ * @pre
+ * `mode != STATS_NONE`.
+ *
+ * **Effects**: prints to stderr.
+ */
+static void report_stats(enum stats_mode mode, const struct arr3d_stats *stats,
+                         const struct faults *fill,
+                         const struct faults *format,
+                         const struct perf_counts *fill_perf,
+                         const struct perf_counts *format_perf) {
+    if (mode == STATS_JSON) {
         fprintf(stderr,
-                "wrong usage!\n"
-                "usage: %s <x> <y> <z>\n",
-                pname);
+                "{\"allocs\": %zu, \"failed_allocs\": %zu, "
+                "\"table_bytes\": %zu, \"elem_bytes\": %zu, "
+                "\"arena_bytes\": %zu, \"alloc_ns\": %" PRIu64 ", "
+                "\"unwind_ns\": %" PRIu64 ", \"fill_minor_faults\": %ld, "
+                "\"fill_major_faults\": %ld, \"format_minor_faults\": %ld, "
+                "\"format_major_faults\": %ld, \"fill_cycles\": %" PRIu64
+                ", \"fill_max_cycles\": %" PRIu64 ", \"fill_threads\": %zu, "
+                "\"format_cycles\": %" PRIu64 ", \"format_max_cycles\": %" PRIu64
+                ", \"format_threads\": %zu, \"write_cycles\": %" PRIu64,
+                stats->allocs, stats->failed_allocs, stats->table_bytes,
+                stats->elem_bytes, stats->arena_bytes, stats->alloc_ns,
+                stats->unwind_ns, fill->minor, fill->major, format->minor,
+                format->major, stats->fill_cycles, stats->fill_max_cycles,
+                stats->fill_threads, stats->format_cycles,
+                stats->format_max_cycles, stats->format_threads,
+                stats->write_cycles);
+        const char *names[2] = {"fill", "format"};
+        const struct perf_counts *perfs[2] = {fill_perf, format_perf};
+        for (size_t p = 0; p < 2 && fill_perf != NULL; p++)
+            fprintf(stderr,
+                    ", \"%s_hw_cycles\": %" PRIu64 ", \"%s_instructions\": "
+                    "%" PRIu64 ", \"%s_cache_refs\": %" PRIu64
+                    ", \"%s_cache_misses\": %" PRIu64,
+                    names[p], perfs[p]->n[PERF_CYCLES], names[p],
+                    perfs[p]->n[PERF_INSTRUCTIONS], names[p],
+                    perfs[p]->n[PERF_CACHE_REFS], names[p],
+                    perfs[p]->n[PERF_CACHE_MISSES]);
+        fprintf(stderr, "}\n");
+        return;
+    }
+    fprintf(stderr,
+            "stats allocs: %zu successful, %zu failed, %" PRIu64
+            " ns in allocator\n"
+            "stats bytes: %zu in tables, %zu in elements, %zu total, "
+            "%zu in arena\n"
+            "stats unwind: %" PRIu64 " ns\n"
+            "stats faults: %ld minor, %ld major populating, %ld minor, "
+            "%ld major formatting\n",
+            stats->allocs, stats->failed_allocs, stats->alloc_ns,
+            stats->table_bytes, stats->elem_bytes,
+            stats->table_bytes + stats->elem_bytes, stats->arena_bytes,
+            stats->unwind_ns, fill->minor, fill->major,
+            format->minor, format->major);
+    fprintf(stderr,
+            "stats cycles: %" PRIu64 " populating by %zu threads, at most %"
+            PRIu64 " by one, %" PRIu64 " formatting by %zu threads, at most %"
+            PRIu64 " by one, %" PRIu64 " writing\n",
+            stats->fill_cycles, stats->fill_threads, stats->fill_max_cycles,
+            stats->format_cycles, stats->format_threads,
+            stats->format_max_cycles, stats->write_cycles);
+    if (fill_perf != NULL) {
+        report_perf("populating", fill_perf);
+        report_perf("formatting", format_perf);
+    }
+}
+
+/** Read number from start of file.
+ *
+ * @param path path of the file.
+ * @param[out] v pointer to store the number.
+ *
+ * @return if the file could be read and starts with a number.
+ *
+ * @pre
+ * `path` is nul-terminated.
+ *
+ * **Effects**: writes `*v` on success.
+ */
+static bool read_number_file(const char *path, uintmax_t *v) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return false;
+    bool ok = fscanf(f, "%ju", v) == 1;
+    fclose(f);
+    return ok;
+}
+
+/** Get memory available to the process.
+ *
+ * Takes the lower of `MemAvailable` in `/proc/meminfo` and the headroom
+ * below the memory limit of the cgroup, either v2 or v1.
+ *
+ * @return number of bytes available, or 0 if unknown.
+ */
+static size_t available_memory(void) {
+    uintmax_t avail = UINTMAX_MAX, limit, usage;
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f != NULL) {
+        char line[128];
+        uintmax_t kib;
+        while (fgets(line, sizeof(line), f) != NULL)
+            if (sscanf(line, "MemAvailable: %ju kB", &kib) == 1) {
+                avail = kib <= UINTMAX_MAX / 1024 ? kib * 1024 : UINTMAX_MAX;
+                break;
+            }
+        fclose(f);
+    }
+    // An unlimited cgroup v2 reads "max", and so fails to parse
+    if ((read_number_file("/sys/fs/cgroup/memory.max", &limit) &&
+         read_number_file("/sys/fs/cgroup/memory.current", &usage)) ||
+        (read_number_file("/sys/fs/cgroup/memory/memory.limit_in_bytes",
+                          &limit) &&
+         read_number_file("/sys/fs/cgroup/memory/memory.usage_in_bytes",
+                          &usage))) {
+        uintmax_t headroom = limit > usage ? limit - usage : 1;
+        if (headroom < avail)
+            avail = headroom;
+    }
+    if (avail == UINTMAX_MAX)
+        return 0;
+    return avail < SIZE_MAX ? (size_t)avail : SIZE_MAX;
+}
+
+/** Report planned storage of array to stdout.
+ *
+ * @param plan planned allocations.
+ * @param bytes planned total number of bytes.
+ * @param mem_limit limit on the number of bytes, or 0.
+ *
+ * @return if printing was successful.
+ *
+ * **Effects**: prints to stdout, may print to stderr.
+ */
+static bool print_plan(const struct arr3d_stats *plan, size_t bytes,
+                       size_t mem_limit) {
+    int ret = printf("planned %zu allocations: %zu bytes in tables, %zu bytes "
+                     "in elements, %zu bytes in total",
+                     plan->allocs, plan->table_bytes, plan->elem_bytes, bytes);
+    if (ret >= 0 && plan->arena_bytes > 0)
+        ret = printf(", carved out of an arena");
+    if (ret >= 0 && mem_limit > 0)
+        ret = printf(", %zu bytes available", mem_limit);
+    if (ret < 0 || putchar('\n') == EOF) {
+        perror("value output");
+        return false;
+    }
+    return true;
+}
+
+/** Open output file, if any.
+ *
+ * The file is opened for reading and writing for binary output, so that it
+ * can be mapped.
+ *
+ * @param[in,out] opts options whose `out_fd` to set.
+ *
+ * @pre
+ * `opts->out`, if not NULL, is nul-terminated.
+ *
+ * **Effects**: may open file, writes `opts->out_fd`, may print to stderr, may
+ * exit program.
+ */
+static void open_output(struct opts *opts) {
+    if (opts->out == NULL)
+        return;
+    int mode = opts->format == ARR3D_FORMAT_TEXT ? O_WRONLY : O_RDWR;
+    opts->out_fd = open(opts->out, mode | O_CREAT | O_TRUNC, 0666);
+    if (opts->out_fd < 0) {
+        perror("output file");
         exit(EXIT_FAILURE);
     }
 }
 
-/** Print elements of array.
+
+/** Describe failure of a library function.
  *
- * @param arr array to print.
- * @param x size of `arr`.
- * @param y size of elements of `arr`.
- * @param z size of elements of elements of `arr`.
+ * @param status status returned by the function, not `ARR3D_OK`.
+ * @param[out] msg buffer of `ARG_ERROR_LEN` bytes to store the description
+ * in, ending with a newline.
  *
  * @pre
- * for all `i < x`, `j < y`, `k < z`, `arr[i][j][k]` is defined.
+ * `errno` is as left by the function.
+ *
+ * **Effects**: writes `msg`.
+ */
+static void status_message(enum arr3d_status status, char *msg) {
+    if (status == ARR3D_NPY)
+        snprintf(msg, ARG_ERROR_LEN,
+                 "npy format does not support %zu-byte elements\n",
+                 sizeof(elem));
+    else
+        snprintf(msg, ARG_ERROR_LEN, "%s: %s\n", arr3d_strstatus(status),
+                 strerror(errno));
+}
+
+/** Report failure of a library function.
+ *
+ * @param status status returned by the function, not `ARR3D_OK`.
+ *
+ * @pre
+ * `errno` is as left by the function.
+ *
+ * **Effects**: prints to stderr.
+ */
+static void report_status(enum arr3d_status status) {
+    char msg[ARG_ERROR_LEN];
+    status_message(status, msg);
+    fputs(msg, stderr);
+}
+
+/** Write whole buffer.
  *
- * **Owns**
- * - `arr`.
- * - `arr[i]` for all `i < x`.
- * - `arr[i][j]` for all `i < x`, `j < y`.
+ * @param fd file descriptor to write to.
+ * @param buf bytes to write.
+ * @param len number of bytes.
  *
- * **Effects**: prints to stdout, may print to stderr, may exit program.
+ * @return if all bytes could be written.
+ *
+ * **Effects**: writes to `fd`, may write `errno`.
+ */
+static bool write_all(int fd, const char *buf, size_t len) {
+    struct fixed_output out = {(const unsigned char *)buf, len};
+    size_t written;
+    return write_fixed(&out, fd, &written) == ARR3D_OK;
+}
+
+/** Respond to request with error.
+ *
+ * @param fd file descriptor to respond to.
+ * @param msg description of the error, ending with a newline.
+ *
+ * @return if the response could be written.
+ *
+ * **Effects**: writes to `fd`, may write `errno`.
  */
-static void print_arr(elem ***arr, size_t x, size_t y, size_t z) {
-    for (size_t i = 0; i < x; i++)
-        for (size_t j = 0; j < y; j++)
-            for (size_t k = 0; k < z; k++)
-                if (printf("arr[%zu][%zu][%zu] = %lu\n", i, j, k,
-                           arr[i][j][k]) < 0) {
-                    perror("value output");
-                    free_complete_arr(arr, x, y);
-                    exit(EXIT_FAILURE);
-                }
+static bool respond_error(int fd, const char *msg) {
+    char line[ARG_ERROR_LEN + sizeof("error ")];
+    int len = snprintf(line, sizeof(line), "error %s", msg);
+    return write_all(fd, line, (size_t)len);
+}
+
+/** Answer request for the output of one box.
+ *
+ * The request is a line of the three positional arguments of the program.
+ * The response is a line `ok <allocs> <len>`, followed by `len` bytes of
+ * output, or a line `error <message>`.
+ *
+ * @param opts options of the array and output, without mapped output.
+ * @param[in,out] arr pointer to the handle reused between requests, or to
+ * NULL before the first one.
+ * @param line request, split in place.
+ * @param buf_fd file to format output into before it is sent.
+ * @param fd file descriptor to respond to.
+ *
+ * @return if the response could be written.
+ *
+ * @pre
+ * `line` is nul-terminated.
+ *
+ * **Effects**: writes `line`, may allocate, may create `*arr` and write
+ * `*arr`, writes to `buf_fd` and `fd`, may write `errno`.
+ */
+static bool answer(const struct opts *opts, struct arr3d **arr, char *line,
+                   int buf_fd, int fd) {
+    char *names[3] = {"x", "y", "z"};
+    struct arr3d_range box[3];
+    char msg[ARG_ERROR_LEN];
+    char *save;
+    char *arg = strtok_r(line, " \t\r\n", &save);
+    for (size_t d = 0; d < 3; d++) {
+        if (arg == NULL)
+            return respond_error(fd, "expected <x> <y> <z>\n");
+        if (!parse_range(arg, names[d], &box[d], msg))
+            return respond_error(fd, msg);
+        arg = strtok_r(NULL, " \t\r\n", &save);
+    }
+    if (arg != NULL)
+        return respond_error(fd, "expected <x> <y> <z>\n");
+    size_t oi, oj, ok;
+    if (!opts->arr.wrap && arr3d_find_overflow(box, &oi, &oj, &ok)) {
+        snprintf(msg, sizeof(msg),
+                 "value of arr[%zu][%zu][%zu] does not fit into %zu bits\n",
+                 oi, oj, ok, sizeof(elem) * CHAR_BIT);
+        return respond_error(fd, msg);
+    }
+    enum arr3d_status status = *arr == NULL
+                                   ? arr3d_create_box(arr, box, &opts->arr)
+                                   : arr3d_set_box(*arr, box);
+    struct fixed_output fixed = {NULL, 0};
+    bool use_fixed =
+        opts->fixed && opts->arr.compression == ARR3D_COMPRESSION_NONE &&
+        find_fixed(box, opts->format, &fixed);
+    size_t allocs, len;
+    if (status == ARR3D_OK)
+        status = use_fixed ? plan_only(*arr, opts->arr.mem_limit, &allocs)
+                           : arr3d_fill(*arr, &allocs);
+    if (status == ARR3D_OK && !use_fixed) {
+        // The file keeps its pages between requests, and only the first
+        // `len` bytes of them are sent
+        if (lseek(buf_fd, 0, SEEK_SET) != 0)
+            status = ARR3D_BUFFER;
+        else
+            status = arr3d_format(*arr, opts->format, buf_fd, &len);
+    }
+    if (status != ARR3D_OK) {
+        if (status == ARR3D_OUTPUT)
+            status = ARR3D_BUFFER;
+        status_message(status, msg);
+        return respond_error(fd, msg);
+    }
+    if (use_fixed)
+        len = fixed.len;
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "ok %zu %zu\n", allocs,
+                              len);
+    if (!write_all(fd, header, (size_t)header_len))
+        return false;
+    if (use_fixed)
+        return write_fixed(&fixed, fd, &len) == ARR3D_OK;
+    if (len == 0)
+        return true;
+    // Copied instead of sent with `sendfile`, whose pages spliced into a pipe
+    // would change with the output of the next request
+    char *map = mmap(NULL, len, PROT_READ, MAP_SHARED, buf_fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    bool sent = write_all(fd, map, len);
+    munmap(map, len);
+    return sent;
+}
+
+/** Answer requests of a stream until its end.
+ *
+ * Blank lines are skipped.
+ *
+ * @param opts options of the array and output, without mapped output.
+ * @param[in,out] arr pointer to the handle reused between requests, or to
+ * NULL before the first one.
+ * @param in stream to read requests from.
+ * @param buf_fd file to format output into before it is sent.
+ * @param fd file descriptor to respond to.
+ *
+ * @return if all requests could be read and answered.
+ *
+ * **Effects**: reads `in`, may allocate, may create `*arr` and write `*arr`,
+ * writes to `buf_fd` and `fd`, may print to stderr.
+ */
+static bool answer_stream(const struct opts *opts, struct arr3d **arr,
+                          FILE *in, int buf_fd, int fd) {
+    char *line = NULL;
+    size_t cap = 0;
+    bool ok = true;
+    while (ok && getline(&line, &cap, in) >= 0) {
+        if (line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        ok = answer(opts, arr, line, buf_fd, fd);
+        if (!ok)
+            perror("value output");
+    }
+    if (ok && ferror(in)) {
+        perror("request input");
+        ok = false;
+    }
+    free(line);
+    return ok;
+}
+
+/** Answer requests of connections to a Unix socket, one at a time.
+ *
+ * A stale socket at the path, left behind by an earlier server, is replaced.
+ *
+ * @param opts options of the array and output, without mapped output, whose
+ * `listen` is the path of the socket.
+ * @param[in,out] arr pointer to the handle reused between requests, or to
+ * NULL before the first one.
+ * @param buf_fd file to format output into before it is sent.
+ *
+ * @return false, if the socket could not be created or accept failed.
+ *
+ * @pre
+ * `opts->listen` is nul-terminated.
+ *
+ * **Effects**: creates the socket, ignores `SIGPIPE`, may allocate, may
+ * create `*arr` and write `*arr`, writes to `buf_fd`, may print to stderr.
+ */
+static bool listen_requests(const struct opts *opts, struct arr3d **arr,
+                            int buf_fd) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(opts->listen) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path is too long\n");
+        return false;
+    }
+    strcpy(addr.sun_path, opts->listen);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return false;
+    }
+    struct stat st;
+    if (stat(opts->listen, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(opts->listen);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(sock, SOMAXCONN) != 0) {
+        perror("socket");
+        close(sock);
+        return false;
+    }
+    // A client hanging up only ends its own connection
+    signal(SIGPIPE, SIG_IGN);
+    for (;;) {
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+        if (conn < 0)
+            break;
+        FILE *in = fdopen(conn, "r");
+        if (in == NULL) {
+            perror("request input");
+            close(conn);
+            continue;
+        }
+        answer_stream(opts, arr, in, buf_fd, conn);
+        fclose(in);
+    }
+    perror("socket");
+    close(sock);
+    return false;
+}
+
+/** Answer batch requests, or requests of connections to a Unix socket.
+ *
+ * @param opts options of the array and output, selecting the source of the
+ * requests.
+ *
+ * @return exit status of the program.
+ *
+ * @pre
+ * `opts->batch` or `opts->listen` is not NULL.
+ *
+ * **Effects**: may open files, may allocate, reads requests and writes
+ * responses, may print to stderr.
+ */
+static int serve(struct opts *opts) {
+    if (opts->bench || opts->stats != STATS_NONE || opts->dry_run ||
+        opts->cache != NULL) {
+        fprintf(stderr, "--bench, --stats, --perf, --dry-run and --cache do "
+                        "not apply to requests\n");
+        return EXIT_FAILURE;
+    }
+    if (opts->check_mem) {
+        opts->arr.mem_limit = available_memory();
+        if (opts->arr.mem_limit == 0)
+            fprintf(stderr, "cannot determine available memory\n");
+    }
+    int buf_fd = memfd_create("3darr", MFD_CLOEXEC);
+    if (buf_fd < 0) {
+        perror("output buffer allocation");
+        return EXIT_FAILURE;
+    }
+    struct arr3d *arr = NULL;
+    bool ok;
+    if (opts->listen != NULL) {
+        ok = listen_requests(opts, &arr, buf_fd);
+    } else {
+        open_output(opts);
+        FILE *in = strcmp(opts->batch, "-") == 0 ? stdin
+                                                 : fopen(opts->batch, "r");
+        if (in == NULL) {
+            perror("request input");
+            ok = false;
+        } else {
+            ok = answer_stream(opts, &arr, in, buf_fd, opts->out_fd);
+            if (in != stdin)
+                fclose(in);
+        }
+        if (opts->out != NULL && close(opts->out_fd) != 0) {
+            perror("value output");
+            ok = false;
+        }
+    }
+    arr3d_destroy(arr);
+    close(buf_fd);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 /** Main function of the `3darr` program.
  *
- * Allocates a 3D array with dimensions specified by the arguments, populates it
- * with unique values, and prints it.
+ * Allocates a 3D array with dimensions specified by the arguments, or a box of
+ * selected indices of it, populates it with unique values, and prints it.
  */
 int main(int argc, char **argv) {
-    ensure_usage(argc, argv[0]);
-    size_t x = get_arg_size_t(argv[1], "x");
-    size_t y = get_arg_size_t(argv[2], "y");
-    size_t z = get_arg_size_t(argv[3], "z");
+    struct bench_clock clock;
+    bench_now(&clock);
+    struct opts opts;
+    int argi = parse_opts(argc, argv, &opts);
+    if (opts.batch != NULL || opts.listen != NULL) {
+        if (argi != argc || (opts.batch != NULL && opts.listen != NULL))
+            exit_usage(argc, argv[0]);
+        return serve(&opts);
+    }
+    ensure_usage(argc, argi, argv[0]);
+    const struct arr3d_range box[3] = {
+        get_arg_range(argv[argi], "x"),
+        get_arg_range(argv[argi + 1], "y"),
+        get_arg_range(argv[argi + 2], "z"),
+    };
+    size_t oi, oj, ok;
+    if (!opts.arr.wrap && arr3d_find_overflow(box, &oi, &oj, &ok)) {
+        fprintf(stderr,
+                "value of arr[%zu][%zu][%zu] does not fit into %zu bits\n",
+                oi, oj, ok, sizeof(elem) * CHAR_BIT);
+        return EXIT_FAILURE;
+    }
+    if (opts.bench)
+        bench_report("parse", &clock, 0);
+    if (opts.check_mem) {
+        opts.arr.mem_limit = available_memory();
+        if (opts.arr.mem_limit == 0)
+            fprintf(stderr, "cannot determine available memory\n");
+    }
+    if (opts.dry_run) {
+        // The output file is not touched, and its mapping is planned like
+        // the flat array stored in it
+        if (maps_output(&opts))
+            opts.arr.layout = ARR3D_LAYOUT_FLAT;
+    } else {
+        open_output(&opts);
+        if (maps_output(&opts)) {
+            opts.arr.map_fd = opts.out_fd;
+            opts.arr.map_format = opts.format;
+        }
+    }
+    struct arr3d *arr;
+    enum arr3d_status status = arr3d_create_box(&arr, box, &opts.arr);
+    if (status != ARR3D_OK) {
+        report_status(status);
+        return EXIT_FAILURE;
+    }
+    if (opts.dry_run) {
+        struct arr3d_stats plan;
+        size_t bytes;
+        status = arr3d_plan(arr, &plan, &bytes);
+        arr3d_destroy(arr);
+        if (status != ARR3D_OK) {
+            report_status(status);
+            return EXIT_FAILURE;
+        }
+        if (!print_plan(&plan, bytes, opts.arr.mem_limit))
+            return EXIT_FAILURE;
+        if (opts.arr.mem_limit > 0 && bytes > opts.arr.mem_limit) {
+            errno = ENOMEM;
+            report_status(ARR3D_MEMORY);
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    // Fixed shapes skip populating and formatting, which have no statistics
+    struct fixed_output fixed = {NULL, 0};
+    bool use_fixed = opts.fixed && opts.stats == STATS_NONE &&
+                     opts.arr.compression == ARR3D_COMPRESSION_NONE &&
+                     find_fixed(box, opts.format, &fixed);
+    // So does cached output, likewise
+    struct cache_entry cache;
+    bool use_cache =
+        !use_fixed && opts.cache != NULL && opts.stats == STATS_NONE;
+    bool cached = use_cache && open_cache(&opts, box, &cache);
+    struct faults faults = {0, 0}, fill_faults, format_faults = {0, 0};
+    struct perf perf;
+    struct perf_counts counts = {{0}}, fill_perf, format_perf = {{0}};
+    bool use_perf = opts.perf && perf_open(&perf);
+    if (opts.perf && !use_perf)
+        perror("perf counters");
+    count_faults(&faults, &fill_faults);
+    if (use_perf)
+        count_perf(&perf, &counts, &fill_perf);
     size_t allocs;
-    elem ***arr = mk_arr(x, y, z, &allocs);
-    if (!print_allocs(allocs)) {
+    status = use_fixed || cached ? plan_only(arr, opts.arr.mem_limit, &allocs)
+                                 : arr3d_fill(arr, &allocs);
+    count_faults(&faults, &fill_faults);
+    if (use_perf)
+        count_perf(&perf, &counts, &fill_perf);
+    struct arr3d_stats stats;
+    arr3d_get_stats(arr, &stats);
+    if (status != ARR3D_OK) {
+        report_status(status);
+        if (status == ARR3D_ALLOC)
+            print_allocs(report_stream(&opts), allocs);
+        if (opts.stats != STATS_NONE)
+            report_stats(opts.stats, &stats, &fill_faults, &format_faults,
+                         use_perf ? &fill_perf : NULL, &format_perf);
+        if (use_cache)
+            close_cache(&cache);
+        arr3d_destroy(arr);
+        return EXIT_FAILURE;
+    }
+    if (opts.bench) {
+        bench_report("mk_arr", &clock, 0);
+        if (report_stream(&opts) != stderr)
+            print_allocs(stderr, allocs);
+        bench_now(&clock);
+    }
+    if (!print_allocs(report_stream(&opts), allocs) || fflush(stdout) == EOF) {
+        perror("value output");
+        if (use_cache)
+            close_cache(&cache);
+        arr3d_destroy(arr);
+        return EXIT_FAILURE;
+    }
+    size_t bytes;
+    if (use_fixed)
+        status = write_fixed(&fixed, opts.out_fd, &bytes);
+    else if (cached)
+        status = send_cache(&cache, opts.out_fd, &bytes);
+    else if (use_cache)
+        status = format_cache(arr, opts.format, &cache, opts.out_fd, &bytes);
+    else
+        status = arr3d_format(arr, opts.format, opts.out_fd, &bytes);
+    if (use_cache)
+        close_cache(&cache);
+    if (status != ARR3D_OK) {
+        report_status(status);
+        arr3d_destroy(arr);
+        return EXIT_FAILURE;
+    }
+    if (opts.bench)
+        bench_report("print_arr", &clock, bytes);
+    if (opts.stats != STATS_NONE) {
+        count_faults(&faults, &format_faults);
+        if (use_perf) {
+            count_perf(&perf, &counts, &format_perf);
+            perf_close(&perf);
+        }
+        // Again, for the counters of formatting
+        arr3d_get_stats(arr, &stats);
+        report_stats(opts.stats, &stats, &fill_faults, &format_faults,
+                     use_perf ? &fill_perf : NULL, &format_perf);
+    }
+    arr3d_destroy(arr);
+    if (opts.out != NULL && close(opts.out_fd) != 0) {
         perror("value output");
-        free_complete_arr(arr, x, y);
         return EXIT_FAILURE;
     }
-    print_arr(arr, x, y, z);
-    free_complete_arr(arr, x, y);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+
+/**
+ * @file bench_kernels.c
+ * Code comprising the `bench_kernels` program.
+ * Times the kernels of `lib3darr` and `3darr` in isolation, and compares the
+ * results against a baseline of an earlier run.
+ * The implicit preconditions stated in `lib3darr.c` apply here as well.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Allocations `malloc` of `lib3darr` still serves before failing, or
+ * `SIZE_MAX` to never fail. Populating jobs share it.
+ */
+static atomic_size_t malloc_budget = SIZE_MAX;
+
+/** `malloc` that fails once `malloc_budget` is used up.
+ *
+ * @param len number of bytes to allocate.
+ *
+ * @return allocated block, or NULL, and `errno` is set.
+ *
+ * **Effects**: may allocate, may write `malloc_budget` and `errno`.
+ */
+static void *budget_malloc(size_t len) {
+    size_t budget = atomic_load(&malloc_budget);
+    while (budget != SIZE_MAX) {
+        if (budget == 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        if (atomic_compare_exchange_weak(&malloc_budget, &budget, budget - 1))
+            break;
+    }
+    return malloc(len);
+}
+
+// The kernels are static, so both sources are compiled in here, with the
+// program's `main` and its `write_all`, which `lib3darr` also defines,
+// renamed
+#define main main_3darr
+#define write_all write_all_3darr
+#include "3darr.c"
+#undef main
+#undef write_all
+#define malloc budget_malloc
+#include "lib3darr.c"
+#undef malloc
+
+/** Nanoseconds each timed run of a benchmark lasts at least. */
+#define RUN_NS 20000000u
+
+/** Number of timed runs of a benchmark, of which the fastest counts. */
+#define RUNS 5
+
+/** Maximal length of the name of a benchmark, including the nul. */
+#define NAME_LEN 32
+
+/** Length of the row filled by `bench_fill_row`. */
+#define ROW_LEN 4096
+
+/** Number of values formatted by `bench_fmt_elem` per repetition. */
+#define FMT_VALUES 256
+
+/** Sizes of each dimension of the tree freed by the free benchmarks. */
+#define TREE_DIM 32
+
+/** Number of allocations of a tree of `TREE_DIM` in each dimension. */
+#define TREE_ALLOCS (1 + TREE_DIM + TREE_DIM * TREE_DIM)
+
+/** Sink for results, so that the benchmarks are not optimized out. */
+static volatile uintmax_t bench_sink;
+
+/**
+ * Benchmark of one kernel.
+ *
+ * `run` repeats the kernel `reps` times, stores the number of operations it
+ * performed, and returns the nanoseconds they took, or 0 on failure.
+ */
+struct bench {
+    /** Name of the benchmark. */
+    const char *name;
+    /** Function running the benchmark. */
+    uint64_t (*run)(size_t reps, size_t *ops);
+};
+
+/** Result of a benchmark. */
+struct result {
+    /** Name of the benchmark, nul-terminated. */
+    char name[NAME_LEN];
+    /** Nanoseconds per operation of the fastest run. */
+    double ns_per_op;
+};
+
+/** Create handle of array for the benchmarks.
+ *
+ * @param box selected indices of each dimension.
+ * @param layout storage layout.
+ * @param jobs number of populating jobs.
+ *
+ * @return handle, or NULL, and an error is printed.
+ *
+ * **Effects**: allocates, may print to stderr.
+ */
+static struct arr3d *bench_arr(const struct arr3d_range box[3],
+                               enum arr3d_layout layout, size_t jobs) {
+    const struct arr3d_opts opts = {
+        .layout = layout,
+        .jobs = jobs,
+        .wrap = true,
+        .map_fd = -1,
+        .count_cycles = false,
+    };
+    struct arr3d *arr;
+    enum arr3d_status status = arr3d_create_box(&arr, box, &opts);
+    if (status != ARR3D_OK) {
+        perror(arr3d_strstatus(status));
+        return NULL;
+    }
+    return arr;
+}
+
+/** Benchmark `elem_pow` over all exponents below 64. */
+static uint64_t bench_elem_pow(size_t reps, size_t *ops) {
+    uintmax_t acc = 0;
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < reps; r++)
+        for (size_t y = 0; y < 64; y++)
+            acc += (uintmax_t)elem_pow(3 + (elem)(r & 1), y);
+    uint64_t ns = now_ns() - start;
+    bench_sink = acc;
+    *ops = reps * 64;
+    return ns;
+}
+
+/** Benchmark `fill_row` on rows of `ROW_LEN` elements. */
+static uint64_t bench_fill_row(size_t reps, size_t *ops) {
+    const struct arr3d_range box[3] = {{0, 1, 1}, {0, 1, 1}, {0, ROW_LEN, 1}};
+    struct arr3d *arr = bench_arr(box, ARR3D_LAYOUT_STREAM, 1);
+    elem *row = malloc(ROW_LEN * sizeof(elem));
+    if (arr == NULL || row == NULL) {
+        free(row);
+        arr3d_destroy(arr);
+        return 0;
+    }
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < reps; r++) {
+        fill_row(&arr->arr, row, 0, 0, 0, ROW_LEN);
+        bench_sink = row[r % ROW_LEN];
+    }
+    uint64_t ns = now_ns() - start;
+    free(row);
+    arr3d_destroy(arr);
+    *ops = reps * ROW_LEN;
+    return ns;
+}
+
+/** Benchmark `fmt_elem` on values of all lengths. */
+static uint64_t bench_fmt_elem(size_t reps, size_t *ops) {
+    elem values[FMT_VALUES];
+    for (size_t v = 0; v < FMT_VALUES; v++)
+        values[v] = elem_pow(3, v % 41) * (elem)(v + 1);
+    char buf[DEC_LEN(elem) + 1];
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < reps; r++)
+        for (size_t v = 0; v < FMT_VALUES; v++)
+            bench_sink = (uintmax_t)(fmt_elem(buf, values[v]) - buf);
+    uint64_t ns = now_ns() - start;
+    *ops = reps * FMT_VALUES;
+    return ns;
+}
+
+/** Benchmark `fmt_size` on indices like those of output lines. */
+static uint64_t bench_fmt_size(size_t reps, size_t *ops) {
+    char buf[DEC_LEN(size_t) + 1];
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < reps; r++)
+        bench_sink = (uintmax_t)(fmt_size(buf, r % 100000) - buf);
+    uint64_t ns = now_ns() - start;
+    *ops = reps;
+    return ns;
+}
+
+/** Benchmark `format_range` on lines of a lazy array, per line. */
+static uint64_t bench_format_lines(size_t reps, size_t *ops) {
+    const struct arr3d_range box[3] = {{0, 16, 1}, {0, 16, 1}, {0, 64, 1}};
+    struct arr3d *arr = bench_arr(box, ARR3D_LAYOUT_LAZY, 1);
+    size_t allocs;
+    if (arr == NULL || arr3d_fill(arr, &allocs) != ARR3D_OK ||
+        get_out_bufs(arr, 1) != ARR3D_OK) {
+        arr3d_destroy(arr);
+        return 0;
+    }
+    build_k_parts(&arr->arr);
+    size_t total = 16 * 16 * 64;
+    struct out_buf *out = &arr->bufs[0];
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < reps; r++)
+        bench_sink = format_range(&arr->arr, 0, total, out->buf, out->scratch);
+    uint64_t ns = now_ns() - start;
+    arr3d_destroy(arr);
+    *ops = reps * total;
+    return ns;
+}
+
+/** Benchmark `get_arg_size_t` on arguments of several lengths. */
+static uint64_t bench_get_arg_size_t(size_t reps, size_t *ops) {
+    char args[4][DEC_LEN(size_t) + 1] = {"0", "1000", "18446744073",
+                                         " 4294967296"};
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < reps; r++)
+        for (size_t a = 0; a < 4; a++)
+            bench_sink = get_arg_size_t(args[a], "x");
+    uint64_t ns = now_ns() - start;
+    *ops = reps * 4;
+    return ns;
+}
+
+/** Free pointer trees, or unwind populating them after a failure.
+ *
+ * @param jobs number of populating jobs.
+ * @param fail_at number of allocations of `lib3darr` to succeed before one
+ * fails, or `SIZE_MAX` to free complete trees.
+ * @param reps number of trees.
+ * @param[out] ops pointer to store the number of allocations freed.
+ *
+ * @return nanoseconds spent freeing, or 0 on failure.
+ *
+ * **Effects**: allocates and frees, writes `malloc_budget`, writes `*ops`,
+ * may print to stderr.
+ */
+static uint64_t free_trees(size_t jobs, size_t fail_at, size_t reps,
+                           size_t *ops) {
+    const struct arr3d_range box[3] = {
+        {0, TREE_DIM, 1}, {0, TREE_DIM, 1}, {0, TREE_DIM, 1}};
+    struct arr3d *arr = bench_arr(box, ARR3D_LAYOUT_TREE, jobs);
+    if (arr == NULL)
+        return 0;
+    uint64_t ns = 0;
+    *ops = 0;
+    for (size_t r = 0; r < reps; r++) {
+        struct arr3d_stats stats;
+        malloc_budget = fail_at;
+        enum arr3d_status status = mk_arr(&arr->arr, &arr->opts, &stats);
+        malloc_budget = SIZE_MAX;
+        if (fail_at == SIZE_MAX && status == ARR3D_OK) {
+            uint64_t start = now_ns();
+            free_arr(&arr->arr);
+            ns += now_ns() - start;
+        } else if (fail_at != SIZE_MAX && status == ARR3D_ALLOC) {
+            ns += stats.unwind_ns;
+        } else {
+            fprintf(stderr, "unexpected status: %s\n",
+                    arr3d_strstatus(status));
+            arr3d_destroy(arr);
+            return 0;
+        }
+        *ops += stats.allocs;
+    }
+    arr3d_destroy(arr);
+    return ns;
+}
+
+/**
+ * Number of allocations of the tree after which the unwind benchmarks fail,
+ * set by `--fail-at`.
+ */
+static size_t fail_at = TREE_ALLOCS / 2;
+
+/** Benchmark `free_arr` on complete trees, per allocation. */
+static uint64_t bench_free_tree(size_t reps, size_t *ops) {
+    return free_trees(1, SIZE_MAX, reps, ops);
+}
+
+/** Benchmark unwinding a tree after allocation `fail_at` failed. */
+static uint64_t bench_unwind_tree(size_t reps, size_t *ops) {
+    return free_trees(1, fail_at, reps, ops);
+}
+
+/** Benchmark unwinding a tree of four jobs after an allocation failed. */
+static uint64_t bench_unwind_tree_jobs(size_t reps, size_t *ops) {
+    return free_trees(4, fail_at, reps, ops);
+}
+
+/** Benchmarks, in the order they run. */
+static const struct bench benches[] = {
+    {"elem_pow", bench_elem_pow},
+    {"fill_row", bench_fill_row},
+    {"fmt_elem", bench_fmt_elem},
+    {"fmt_size", bench_fmt_size},
+    {"format_lines", bench_format_lines},
+    {"get_arg_size_t", bench_get_arg_size_t},
+    {"free_tree", bench_free_tree},
+    {"unwind_tree", bench_unwind_tree},
+    {"unwind_tree_jobs", bench_unwind_tree_jobs},
+};
+
+/** Number of benchmarks. */
+#define NBENCHES (sizeof(benches) / sizeof(benches[0]))
+
+/** Run benchmark.
+ *
+ * The repetitions are doubled until a run lasts `RUN_NS`, and the fastest
+ * of `RUNS` runs of that many counts.
+ *
+ * @param bench benchmark to run.
+ * @param[out] result result to store.
+ *
+ * @return if the benchmark succeeded.
+ *
+ * **Effects**: runs the benchmark, writes `*result`.
+ */
+static bool run_bench(const struct bench *bench, struct result *result) {
+    snprintf(result->name, sizeof(result->name), "%s", bench->name);
+    size_t reps = 1, ops;
+    uint64_t ns;
+    while ((ns = bench->run(reps, &ops)) < RUN_NS && ns > 0 &&
+           reps < SIZE_MAX / 2)
+        reps *= 2;
+    if (ns == 0 || ops == 0)
+        return false;
+    result->ns_per_op = (double)ns / (double)ops;
+    for (size_t r = 1; r < RUNS; r++) {
+        ns = bench->run(reps, &ops);
+        if (ns == 0 || ops == 0)
+            return false;
+        if ((double)ns / (double)ops < result->ns_per_op)
+            result->ns_per_op = (double)ns / (double)ops;
+    }
+    return true;
+}
+
+/** Read results of an earlier run, as printed by `main`.
+ *
+ * Lines that are not results are skipped.
+ *
+ * @param path path of the file.
+ * @param[out] results buffer of `NBENCHES` results to store them in.
+ *
+ * @return number of results read, or `SIZE_MAX` if the file could not be
+ * opened.
+ *
+ * @pre
+ * `path` is nul-terminated.
+ *
+ * **Effects**: reads the file, writes `results`.
+ */
+static size_t read_baseline(const char *path, struct result *results) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return SIZE_MAX;
+    char line[256];
+    size_t n = 0;
+    while (n < NBENCHES && fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "{\"name\": \"%31[^\"]\", \"ns_per_op\": %lf",
+                   results[n].name, &results[n].ns_per_op) == 2)
+            n++;
+    fclose(f);
+    return n;
+}
+
+/** Main function of the `bench_kernels` program.
+ *
+ * Prints one JSON object with the name and nanoseconds per operation of
+ * each benchmark per line. With `--baseline FILE`, compares them against
+ * the results in `FILE` on stderr, and fails if any benchmark is slower by
+ * more than `--tolerance=PCT` percent, by default 20. `--fail-at=N` makes
+ * the unwind benchmarks fail after `N` allocations of a tree succeeded.
+ */
+int main(int argc, char **argv) {
+    char *baseline = NULL;
+    size_t tolerance = 20;
+    for (int a = 1; a < argc; a++) {
+        char *val;
+        if (strcmp(argv[a], "--baseline") == 0 && a + 1 < argc) {
+            baseline = argv[++a];
+        } else if ((val = match_opt(argv[a], "--tolerance")) != NULL) {
+            tolerance = get_arg_size_t(val, "tolerance");
+        } else if ((val = match_opt(argv[a], "--fail-at")) != NULL) {
+            fail_at = get_arg_size_t(val, "fail-at");
+            if (fail_at == 0 || fail_at >= TREE_ALLOCS) {
+                fprintf(stderr, "argument fail-at must be in 1..%zu\n",
+                        (size_t)TREE_ALLOCS - 1);
+                return EXIT_FAILURE;
+            }
+        } else {
+            fprintf(stderr,
+                    "usage: %s [--baseline FILE] [--tolerance=PCT] "
+                    "[--fail-at=N]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    struct result base[NBENCHES];
+    size_t nbase = 0;
+    if (baseline != NULL) {
+        nbase = read_baseline(baseline, base);
+        if (nbase == SIZE_MAX) {
+            perror("baseline");
+            return EXIT_FAILURE;
+        }
+    }
+    bool ok = true;
+    for (size_t b = 0; b < NBENCHES; b++) {
+        struct result result;
+        if (!run_bench(&benches[b], &result)) {
+            fprintf(stderr, "benchmark %s failed\n", benches[b].name);
+            ok = false;
+            continue;
+        }
+        printf("{\"name\": \"%s\", \"ns_per_op\": %.4f}\n", result.name,
+               result.ns_per_op);
+        fflush(stdout);
+        for (size_t o = 0; o < nbase; o++) {
+            if (strcmp(base[o].name, result.name) != 0)
+                continue;
+            double change = base[o].ns_per_op > 0
+                                ? result.ns_per_op / base[o].ns_per_op - 1
+                                : 0;
+            bool slower = change * 100 > (double)tolerance;
+            fprintf(stderr, "%-18s %10.4f ns/op, baseline %10.4f, %+6.1f%%%s\n",
+                    result.name, result.ns_per_op, base[o].ns_per_op,
+                    change * 100, slower ? "  SLOWER" : "");
+            ok = ok && !slower;
+        }
+    }
+    if (fflush(stdout) == EOF) {
+        perror("result output");
+        return EXIT_FAILURE;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
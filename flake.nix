@@ -11,11 +11,16 @@
           pname = "3darr";
           version = "unstable";
           nativeBuildInputs = with pkgs; [ doxygen graphviz ];
+          buildInputs = with pkgs; [ zstd lz4 ];
+          makeFlags = [ "ZSTD=yes" "LZ4=yes" ];
           outputs = [ "out" "doc" ];
           src = ./.;
           installPhase = ''
             mkdir -p $out/bin
             cp 3darr $out/bin/3darr
+            mkdir -p $out/lib $out/include
+            cp lib3darr.a lib3darr.so $out/lib
+            cp lib3darr.h $out/include
             mkdir -p $doc/share
             cp -r doc $doc/share/doc
           '';
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+
+#include "lib3darr.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file gen_fixed.c
+ * Code comprising the `gen_fixed` program.
+ * Generates `fixed_shapes.h`, the precomputed output of `3darr` for the fixed
+ * shapes given as arguments, using `lib3darr`.
+ * The implicit preconditions stated in `lib3darr.c` apply here as well.
+ */
+
+/** Number of bytes per line of a generated array initializer. */
+#define BYTES_PER_LINE 12
+
+/** Fixed shape to generate output for. */
+struct shape {
+    /** Size of the first dimension. */
+    size_t x;
+    /** Size of the second dimension. */
+    size_t y;
+    /** Size of the third dimension. */
+    size_t z;
+};
+
+/** Parse argument to fixed shape.
+ *
+ * @param arg argument string of the form `x,y,z`.
+ * @param[out] shape shape to store.
+ *
+ * @return if `arg` is a shape of positive sizes.
+ *
+ * @pre
+ * `arg` is nul-terminated.
+ *
+ * **Effects**: writes `*shape`.
+ */
+static bool parse_shape(const char *arg, struct shape *shape) {
+    size_t *dims[3] = {&shape->x, &shape->y, &shape->z};
+    for (size_t d = 0; d < 3; d++) {
+        if (*arg < '0' || *arg > '9')
+            return false;
+        char *end;
+        errno = 0;
+        uintmax_t v = strtoumax(arg, &end, 10);
+        if (errno == ERANGE || v == 0 || v > SIZE_MAX ||
+            *end != (d < 2 ? ',' : '\0'))
+            return false;
+        *dims[d] = (size_t)v;
+        arg = end + 1;
+    }
+    return true;
+}
+
+/** Emit output of array in one format as an array of bytes.
+ *
+ * @param arr filled array to format.
+ * @param format output format.
+ * @param name name of the format, part of the name of the emitted array.
+ * @param shape shape of `arr`, part of the name of the emitted array.
+ *
+ * @return `ARR3D_OK`, a status of `arr3d_format`, or `ARR3D_OUTPUT` if the
+ * output could not be buffered or emitted.
+ *
+ * **Effects**: creates a temporary file, prints to stdout, may write `errno`.
+ */
+static enum arr3d_status emit_output(struct arr3d *arr,
+                                     enum arr3d_format format,
+                                     const char *name,
+                                     const struct shape *shape) {
+    FILE *tmp = tmpfile();
+    if (tmp == NULL)
+        return ARR3D_OUTPUT;
+    size_t len;
+    enum arr3d_status status = arr3d_format(arr, format, fileno(tmp), &len);
+    if (status != ARR3D_OK) {
+        fclose(tmp);
+        return status;
+    }
+    rewind(tmp);
+    printf("static const unsigned char fixed_%s_%zu_%zu_%zu[%zu] = {", name,
+           shape->x, shape->y, shape->z, len);
+    for (size_t b = 0; b < len; b++) {
+        int c = getc(tmp);
+        if (c == EOF) {
+            fclose(tmp);
+            return ARR3D_OUTPUT;
+        }
+        printf("%s0x%02x,", b % BYTES_PER_LINE == 0 ? "\n    " : " ", c);
+    }
+    fclose(tmp);
+    return printf("\n};\n") < 0 ? ARR3D_OUTPUT : ARR3D_OK;
+}
+
+/** Main function of the `gen_fixed` program.
+ *
+ * Prints a header defining, for each shape given as `x,y,z`, the text, raw
+ * and `.npy` output of the full array, and the X-macro `FIXED_SHAPES`
+ * listing the shapes. Values wrap around like with `--wrap`.
+ */
+int main(int argc, char **argv) {
+    struct shape *shapes = calloc(argc, sizeof(struct shape));
+    if (shapes == NULL) {
+        perror("shape allocation");
+        return EXIT_FAILURE;
+    }
+    for (int a = 1; a < argc; a++) {
+        if (!parse_shape(argv[a], &shapes[a])) {
+            fprintf(stderr, "invalid shape %s, expected x,y,z\n", argv[a]);
+            return EXIT_FAILURE;
+        }
+        for (int b = 1; b < a; b++)
+            if (memcmp(&shapes[a], &shapes[b], sizeof(struct shape)) == 0) {
+                fprintf(stderr, "duplicate shape %s\n", argv[a]);
+                return EXIT_FAILURE;
+            }
+    }
+    const struct arr3d_opts opts = {
+        .layout = ARR3D_LAYOUT_FLAT,
+        .jobs = 1,
+        .wrap = true,
+        .map_fd = -1,
+        .compression = ARR3D_COMPRESSION_NONE,
+    };
+    // Whether npy output is supported only depends on the element type
+    bool npy = argc > 1;
+    printf("/* Generated by gen_fixed; do not edit. */\n\n");
+    for (int a = 1; a < argc; a++) {
+        const struct shape *shape = &shapes[a];
+        struct arr3d *arr;
+        size_t allocs;
+        enum arr3d_status status =
+            arr3d_create(&arr, shape->x, shape->y, shape->z, &opts);
+        if (status == ARR3D_OK) {
+            status = arr3d_fill(arr, &allocs);
+            if (status == ARR3D_OK)
+                status = emit_output(arr, ARR3D_FORMAT_TEXT, "text", shape);
+            if (status == ARR3D_OK)
+                status = emit_output(arr, ARR3D_FORMAT_RAW, "raw", shape);
+            if (status == ARR3D_OK && npy) {
+                status = emit_output(arr, ARR3D_FORMAT_NPY, "npy", shape);
+                if (status == ARR3D_NPY) {
+                    npy = false;
+                    status = ARR3D_OK;
+                }
+            }
+            arr3d_destroy(arr);
+        }
+        if (status != ARR3D_OK) {
+            perror(arr3d_strstatus(status));
+            return EXIT_FAILURE;
+        }
+    }
+    printf("\n#define FIXED_HAS_NPY %d\n\n#define FIXED_SHAPES", npy);
+    for (int a = 1; a < argc; a++)
+        printf(" \\\n    X(%zu, %zu, %zu)", shapes[a].x, shapes[a].y,
+               shapes[a].z);
+    free(shapes);
+    if (printf("\n") < 0 || fflush(stdout) == EOF) {
+        perror("header output");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,3362 @@
+#define _GNU_SOURCE
+
+#include "lib3darr.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#endif
+
+/**
+ * @file lib3darr.c
+ * Code comprising the `lib3darr` library.
+ * Allocates 3D arrays, populates them with unique values, and formats them.
+ * Unless specified otherwise, all functions have the implicit precondition of
+ * all their arguments being defined. Unless specified otherwise, all functions
+ * taking pointers have the implicit precondition that these pointers are valid,
+ * and their pointees, if they are pointers, also satisfy the property the
+ * argument itself satisfies. If an effect is not qualified by "may" or does not
+ * express a mere possibility, it is guaranteed. A pointer/array being nul-terminated
+ * implies it is a valid pointer.
+ */
+
+#ifdef HAVE_SDT
+/** USDT probe `name` of provider `lib3darr` with two arguments. */
+#define PROBE2(name, a, b) DTRACE_PROBE2(lib3darr, name, a, b)
+/** USDT probe `name` of provider `lib3darr` with three arguments. */
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(lib3darr, name, a, b, c)
+#else
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif
+
+/** Upper bound on the number of decimal digits of a value of type `t`. */
+#define DEC_LEN(t) (sizeof(t) * CHAR_BIT / 3 + 1)
+
+/** Upper bound on the length of an output line. */
+#define LINE_LEN                                                               \
+    (sizeof("arr[][][] = \n") - 1 + 3 * DEC_LEN(size_t) + DEC_LEN(elem))
+
+/** Upper bound on the length of a `.npy` header. */
+#define NPY_HEADER_LEN (128 + 3 * DEC_LEN(size_t))
+
+/** Upper bound on the length of the `arr[i][j][` part of an output line. */
+#define PREFIX_LEN (sizeof("arr[][][") - 1 + 2 * DEC_LEN(size_t))
+
+/** Size of the output buffer in bytes. */
+#define OUT_BUF_SIZE ((size_t)1 << 20)
+
+/** Maximal size of the third dimension for which a line template is built. */
+#define TEMPLATE_MAX_Z ((size_t)1 << 16)
+
+/** The `k] = ` part of the output lines of one index `k`. */
+struct k_part {
+    /** Text of the part, padded to a fixed size so that it is copied fast. */
+    char text[DEC_LEN(size_t) + 4];
+    /** Length of the text. */
+    unsigned char len;
+};
+
+/**
+ * Allocator of the storage of a pointer tree.
+ *
+ * `free` pairs with `alloc` block by block. If `release` is not NULL, it frees
+ * everything allocated from `ctx` at once, and `ctx` itself, so that blocks
+ * need not be freed one by one.
+ */
+struct allocator {
+    /** Allocate `len` bytes, or return NULL and set `errno`. */
+    void *(*alloc)(void *ctx, size_t len);
+    /** Free block returned by `alloc`, or NULL. */
+    void (*free)(void *ctx, void *ptr);
+    /** Free all blocks and `ctx`, or NULL if unsupported. */
+    void (*release)(void *ctx);
+    /** State passed to the functions. */
+    void *ctx;
+};
+
+/** Number of bits of a mask of NUMA nodes or CPUs. */
+#define NUMA_MASK_BITS ((size_t)CPU_SETSIZE)
+
+/** Number of bits of a word of such a mask. */
+#define NUMA_WORD_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+/** NUMA topology, as far as needed to place workers and pages. */
+struct numa {
+    /** Placement policy. */
+    enum arr3d_numa_policy policy;
+    /** CPUs of each node that has any, or NULL. */
+    cpu_set_t *cpus;
+    /** Number of elements of `cpus`, or 0 if the topology is unknown. */
+    size_t nnodes;
+    /** Mask of the nodes with memory, all zero if unknown. */
+    unsigned long mem_nodes[NUMA_MASK_BITS / NUMA_WORD_BITS];
+};
+
+/**
+ * 3D array of `elem` with dimensions `x`, `y`, `z`.
+ *
+ * In `ARR3D_LAYOUT_TREE`, `tree` owns all storage, allocated from `alloc`,
+ * and `flat`, `rows` and `map` are NULL. In `ARR3D_LAYOUT_FLAT`, `map` if not
+ * NULL, and `flat` otherwise, owns all elements; `tree` and `rows` are either
+ * both NULL or an optional row pointer view into `flat`, where `tree[i]` is
+ * `rows + i * y` and `tree[i][j]` is `flat + (i * y + j) * z`. In
+ * `ARR3D_LAYOUT_STREAM`, `tree`, `flat`, `rows` and `map` are NULL. `powers`
+ * is NULL unless in `ARR3D_LAYOUT_LAZY`, in which it owns the only storage.
+ */
+struct arr {
+    /** Storage layout. */
+    enum arr3d_layout layout;
+    /** Size of the first layer. */
+    size_t x;
+    /** Size of each second layer. */
+    size_t y;
+    /** Size of each third layer. */
+    size_t z;
+    /**
+     * Selected indices of each dimension, of which there are `x`, `y` and
+     * `z`. Element `[i][j][k]` is `2^i_ * 3^j_ * 5^k_`, where `i_` is
+     * `box[0].start + i * box[0].step`, and so on.
+     */
+    struct arr3d_range box[3];
+    /** Pointer tree, or row pointer view in `ARR3D_LAYOUT_FLAT`. */
+    elem ***tree;
+    /**
+     * Backing table of second layer pointers of a view in
+     * `ARR3D_LAYOUT_FLAT`.
+     */
+    elem **rows;
+    /** Backing block of the elements in `ARR3D_LAYOUT_FLAT`. */
+    elem *flat;
+    /**
+     * Mapping containing `flat`, either of the output file or anonymous, or
+     * NULL if `flat` is allocated with `malloc` or `posix_memalign`.
+     */
+    void *map;
+    /** Length of `map` in bytes. */
+    size_t map_len;
+    /**
+     * Powers `2^i` for `i < x`, then `3^j` for `j < y`, then `5^k` for
+     * `k < z`, in `ARR3D_LAYOUT_LAZY`.
+     */
+    elem *powers;
+    /** Allocator of `tree` and its subarrays in `ARR3D_LAYOUT_TREE`. */
+    struct allocator alloc;
+    /** Whether to time allocator calls. */
+    bool time_allocs;
+    /** Whether to count cycles of populating and formatting. */
+    bool count_cycles;
+    /** NUMA placement of the workers populating and formatting the array. */
+    struct numa numa;
+    /**
+     * Line template with the `k] = ` part for each `k < k_parts_len`, shared
+     * by all rows, or NULL if not built.
+     */
+    struct k_part *k_parts;
+    /** Number of elements of `k_parts`, at least `z`. */
+    size_t k_parts_len;
+};
+
+/** Output buffer kept by an array handle. */
+struct out_buf {
+    /**
+     * Page-aligned private mapping of `OUT_BUF_SIZE` bytes, so that its
+     * pages can be spliced into a pipe, and unmapping it never lets the
+     * pages be reused while a pipe still refers to them.
+     */
+    char *buf;
+    /** Scratch buffer of `SCRATCH_ELEMS` elements, or NULL if not needed. */
+    elem *scratch;
+    /**
+     * Private mapping of `zbuf_len` bytes holding `buf` compressed, or NULL
+     * without compression.
+     */
+    char *zbuf;
+    /** Length of `zbuf`, enough for any compressed `buf`. */
+    size_t zbuf_len;
+    /** Compression context, or NULL if not needed. */
+    void *cctx;
+};
+
+/** Maximal number of elements read from an array at once. */
+#define SCRATCH_ELEMS (OUT_BUF_SIZE / sizeof(elem))
+
+/**
+ * Array handle.
+ *
+ * `arr` is defined if `filled`. `bufs` owns `nbufs` output buffers.
+ */
+struct arr3d {
+    /** Array, with its dimensions always defined. */
+    struct arr arr;
+    /** Options of the array. */
+    struct arr3d_opts opts;
+    /** Whether the storage of `arr` is allocated and populated. */
+    bool filled;
+    /** Output buffers, or NULL. */
+    struct out_buf *bufs;
+    /** Number of elements of `bufs`. */
+    size_t nbufs;
+    /** Allocation statistics of the last population of `arr`. */
+    struct arr3d_stats stats;
+};
+
+/** Size of a huge page in bytes. */
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/** Map anonymous memory on huge pages.
+ *
+ * Explicit huge pages are tried first. Then a mapping aligned to
+ * `HUGE_PAGE_SIZE` is created and advised to be backed by transparent huge
+ * pages.
+ *
+ * @param len length of the mapping in bytes, a multiple of `HUGE_PAGE_SIZE`.
+ *
+ * @return pointer to the mapping, or `MAP_FAILED`.
+ *
+ * @pre
+ * `0 < len <= SIZE_MAX - HUGE_PAGE_SIZE`.
+ *
+ * **Effects**: maps memory, may write `errno`.
+ */
+static void *map_huge(size_t len) {
+    void *map;
+#ifdef MAP_HUGETLB
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map != MAP_FAILED)
+        return map;
+#endif
+    // Over-allocate so that an aligned mapping can be cut out
+    map = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return MAP_FAILED;
+    size_t head = (HUGE_PAGE_SIZE - (uintptr_t)map % HUGE_PAGE_SIZE) %
+                  HUGE_PAGE_SIZE;
+    char *start = (char *)map + head;
+    if (head > 0)
+        munmap(map, head);
+    munmap(start + len, HUGE_PAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+    // Only advice, so failure is harmless
+    madvise(start, len, MADV_HUGEPAGE);
+#endif
+    return start;
+}
+
+/** Allocate large block of memory.
+ *
+ * `ARR3D_BACKING_HUGE` falls back to `malloc` if no mapping can be created.
+ *
+ * @param len length of the block in bytes.
+ * @param backing allocation policy.
+ * @param[out] map pointer to store the mapping of the block, or NULL if it
+ * is allocated with `malloc` or `posix_memalign`.
+ * @param[out] map_len pointer to store the length of the mapping.
+ *
+ * @return pointer to the block, or NULL if allocation failed, and `errno` is
+ * set accordingly.
+ *
+ * **Effects**: allocates or maps memory, writes `*map`, may write `*map_len`
+ * and `errno`.
+ */
+static void *alloc_block(size_t len, enum arr3d_backing backing, void **map,
+                         size_t *map_len) {
+    *map = NULL;
+    if (backing == ARR3D_BACKING_ALIGNED) {
+        void *block;
+        int err = posix_memalign(&block, (size_t)sysconf(_SC_PAGESIZE), len);
+        if (err != 0) {
+            errno = err;
+            return NULL;
+        }
+        return block;
+    }
+    if (backing == ARR3D_BACKING_HUGE && len > 0 &&
+        len <= SIZE_MAX - 2 * HUGE_PAGE_SIZE) {
+        size_t huge_len =
+            (len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        void *huge = map_huge(huge_len);
+        if (huge != MAP_FAILED) {
+            *map = huge;
+            *map_len = huge_len;
+            return huge;
+        }
+    }
+    return malloc(len);
+}
+
+/** Free block allocated by `alloc_block`.
+ *
+ * @param block block to free, or NULL.
+ * @param map mapping of the block, or NULL.
+ * @param map_len length of the mapping.
+ *
+ * **Effects**: frees or unmaps `block`.
+ */
+static void free_block(void *block, void *map, size_t map_len) {
+    if (map != NULL)
+        munmap(map, map_len);
+    else
+        free(block);
+}
+
+/** Read list of numbers and ranges like `0-3,8` from sysfs into a mask.
+ *
+ * Numbers beyond `NUMA_MASK_BITS` are ignored.
+ *
+ * @param path path of the file.
+ * @param[out] mask mask of `NUMA_MASK_BITS` bits to store the numbers in.
+ *
+ * @return if the file could be read and parsed.
+ *
+ * @pre
+ * `path` is nul-terminated.
+ *
+ * **Effects**: reads the file, writes `mask`, may write `errno`.
+ */
+static bool read_list(const char *path, unsigned long *mask) {
+    char buf[4096];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len < 0)
+        return false;
+    buf[len] = '\0';
+    memset(mask, 0, NUMA_MASK_BITS / CHAR_BIT);
+    const char *p = buf;
+    while (*p >= '0' && *p <= '9') {
+        char *end;
+        unsigned long from = strtoul(p, &end, 10), to = from;
+        if (*end == '-')
+            to = strtoul(end + 1, &end, 10);
+        for (; from <= to && from < NUMA_MASK_BITS; from++)
+            mask[from / NUMA_WORD_BITS] |= 1UL << from % NUMA_WORD_BITS;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return *p == '\n' || *p == '\0';
+}
+
+/** Load NUMA topology from sysfs.
+ *
+ * Nothing is loaded for `ARR3D_NUMA_NONE`, and a topology that cannot be loaded
+ * is left unknown, since placement is only advice.
+ *
+ * @param[out] numa topology to initialize.
+ * @param policy placement policy.
+ *
+ * **Effects**: may read sysfs, may allocate, writes `*numa`, may write
+ * `errno`.
+ */
+static void load_numa(struct numa *numa, enum arr3d_numa_policy policy) {
+    numa->policy = policy;
+    numa->cpus = NULL;
+    numa->nnodes = 0;
+    memset(numa->mem_nodes, 0, sizeof(numa->mem_nodes));
+    const char *dir = "/sys/devices/system/node";
+    unsigned long nodes[NUMA_MASK_BITS / NUMA_WORD_BITS];
+    char path[64];
+    snprintf(path, sizeof(path), "%s/online", dir);
+    if (policy == ARR3D_NUMA_NONE || !read_list(path, nodes))
+        return;
+    snprintf(path, sizeof(path), "%s/has_memory", dir);
+    if (!read_list(path, numa->mem_nodes))
+        memcpy(numa->mem_nodes, nodes, sizeof(nodes));
+    for (size_t n = 0; n < NUMA_MASK_BITS; n++) {
+        unsigned long cpus[NUMA_MASK_BITS / NUMA_WORD_BITS];
+        snprintf(path, sizeof(path), "%s/node%zu/cpulist", dir, n);
+        if (!(nodes[n / NUMA_WORD_BITS] >> n % NUMA_WORD_BITS & 1) ||
+            !read_list(path, cpus))
+            continue;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t c = 0; c < NUMA_MASK_BITS; c++)
+            if (cpus[c / NUMA_WORD_BITS] >> c % NUMA_WORD_BITS & 1)
+                CPU_SET(c, &set);
+        if (CPU_COUNT(&set) == 0)
+            continue;
+        cpu_set_t *grown =
+            realloc(numa->cpus, (numa->nnodes + 1) * sizeof(cpu_set_t));
+        if (grown == NULL)
+            break;
+        numa->cpus = grown;
+        numa->cpus[numa->nnodes++] = set;
+    }
+}
+
+/** Find node a part of an array is placed on with `ARR3D_NUMA_LOCAL`.
+ *
+ * The array is split into as many contiguous parts as there are nodes.
+ *
+ * @param numa known topology.
+ * @param at index into the array.
+ * @param len length of the array.
+ *
+ * @return index into `numa->cpus`.
+ *
+ * @pre
+ * - `numa->nnodes > 0`.
+ * - `at < len`.
+ */
+static size_t numa_node_at(const struct numa *numa, size_t at, size_t len) {
+    return at / (len / numa->nnodes + (len % numa->nnodes != 0));
+}
+
+/** Prior placement of a thread, to be restored by `numa_restore`. */
+struct placement {
+    /** Whether `cpus` holds the prior CPU affinity. */
+    bool pinned;
+    /** Prior CPU affinity. */
+    cpu_set_t cpus;
+    /** Whether `mode` and `nodes` hold the prior memory policy. */
+    bool interleaved;
+    /** Prior memory policy mode. */
+    int mode;
+    /** Prior memory policy node mask. */
+    unsigned long nodes[NUMA_MASK_BITS / NUMA_WORD_BITS];
+};
+
+/** Place calling thread for handling a part of an array.
+ *
+ * With `ARR3D_NUMA_INTERLEAVE`, pages the thread first touches are
+ * interleaved across the nodes with memory. With `ARR3D_NUMA_LOCAL`, the
+ * thread is pinned to the CPUs of the node of the part, so that its pages are
+ * placed there.
+ *
+ * @param numa topology.
+ * @param at index of the part into the array.
+ * @param len length of the array.
+ * @param[out] saved prior placement to store for `numa_restore`.
+ *
+ * @pre
+ * `at < len`.
+ *
+ * **Effects**: may change the CPU affinity or memory policy of the calling
+ * thread, writes `*saved`, may write `errno`.
+ */
+static void numa_place(const struct numa *numa, size_t at, size_t len,
+                       struct placement *saved) {
+    saved->pinned = false;
+    saved->interleaved = false;
+    if (numa->policy == ARR3D_NUMA_LOCAL && numa->nnodes > 1) {
+        saved->pinned = pthread_getaffinity_np(pthread_self(),
+                                               sizeof(saved->cpus),
+                                               &saved->cpus) == 0 &&
+                        pthread_setaffinity_np(
+                            pthread_self(), sizeof(cpu_set_t),
+                            &numa->cpus[numa_node_at(numa, at, len)]) == 0;
+    }
+#ifdef SYS_set_mempolicy
+    if (numa->policy == ARR3D_NUMA_INTERLEAVE &&
+        syscall(SYS_get_mempolicy, &saved->mode, saved->nodes,
+                NUMA_MASK_BITS, NULL, 0UL) == 0)
+        saved->interleaved =
+            syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, numa->mem_nodes,
+                    NUMA_MASK_BITS) == 0;
+#endif
+}
+
+/** Restore placement of calling thread.
+ *
+ * @param saved placement stored by `numa_place`.
+ *
+ * **Effects**: may change the CPU affinity or memory policy of the calling
+ * thread, may write `errno`.
+ */
+static void numa_restore(const struct placement *saved) {
+    if (saved->pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(saved->cpus),
+                               &saved->cpus);
+#ifdef SYS_set_mempolicy
+    if (saved->interleaved)
+        syscall(SYS_set_mempolicy, saved->mode, saved->nodes, NUMA_MASK_BITS);
+#endif
+}
+
+/** `alloc` of `malloc_allocator`. */
+static void *malloc_alloc(void *ctx, size_t len) {
+    (void)ctx;
+    return malloc(len);
+}
+
+/** `free` of `malloc_allocator`. */
+static void malloc_free(void *ctx, void *ptr) {
+    (void)ctx;
+    free(ptr);
+}
+
+/** Allocator allocating every block separately with `malloc`. */
+static const struct allocator malloc_allocator = {
+    .alloc = malloc_alloc,
+    .free = malloc_free,
+};
+
+/** Read monotonic clock.
+ *
+ * @return nanoseconds since some fixed point in time.
+ */
+static uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+
+/** Read cycle counter.
+ *
+ * @return the time stamp counter on x86-64, or `now_ns` elsewhere.
+ */
+static uint64_t now_cycles(void) {
+#if defined(__GNUC__) && defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+/** Start timing allocator call.
+ *
+ * @param arr array being allocated.
+ *
+ * @return start of the call if `arr->time_allocs`, otherwise 0.
+ */
+static uint64_t alloc_clock(const struct arr *arr) {
+    return arr->time_allocs ? now_ns() : 0;
+}
+
+/** Record allocator call in statistics.
+ *
+ * @param arr array being allocated.
+ * @param start value of `alloc_clock` before the call.
+ * @param ok whether the call succeeded.
+ * @param len number of bytes requested.
+ * @param[in,out] stats statistics to update.
+ * @param[in,out] bytes counter of `stats` to add `len` to on success.
+ *
+ * **Effects**: writes `*stats`.
+ */
+static void count_alloc(const struct arr *arr, uint64_t start, bool ok,
+                        size_t len, struct arr3d_stats *stats, size_t *bytes) {
+    if (arr->time_allocs)
+        stats->alloc_ns += now_ns() - start;
+    if (ok) {
+        stats->allocs++;
+        *bytes += len;
+    } else {
+        stats->failed_allocs++;
+    }
+}
+
+/** Allocate from allocator, recording the call in statistics.
+ *
+ * @param arr array being allocated.
+ * @param alloc allocator to allocate from.
+ * @param len number of bytes to allocate.
+ * @param[in,out] stats statistics to update.
+ * @param[in,out] bytes counter of `stats` to add `len` to on success.
+ *
+ * @return block returned by `alloc`.
+ *
+ * **Effects**: allocates, writes `*stats`, may write `errno`.
+ */
+static void *counted_alloc(const struct arr *arr,
+                           const struct allocator *alloc, size_t len,
+                           struct arr3d_stats *stats, size_t *bytes) {
+    uint64_t start = alloc_clock(arr);
+    void *p = alloc->alloc(alloc->ctx, len);
+    count_alloc(arr, start, p != NULL, len, stats, bytes);
+    return p;
+}
+
+/** Add allocation statistics.
+ *
+ * @param[in,out] dst statistics to add to.
+ * @param src statistics to add.
+ *
+ * **Effects**: writes `*dst`.
+ */
+static void stats_add(struct arr3d_stats *dst, const struct arr3d_stats *src) {
+    dst->allocs += src->allocs;
+    dst->failed_allocs += src->failed_allocs;
+    dst->table_bytes += src->table_bytes;
+    dst->elem_bytes += src->elem_bytes;
+    dst->arena_bytes += src->arena_bytes;
+    dst->alloc_ns += src->alloc_ns;
+    dst->unwind_ns += src->unwind_ns;
+    dst->fill_cycles += src->fill_cycles;
+    if (src->fill_max_cycles > dst->fill_max_cycles)
+        dst->fill_max_cycles = src->fill_max_cycles;
+    dst->fill_threads += src->fill_threads;
+}
+
+/** Record cycles one thread spent formatting in statistics.
+ *
+ * @param[in,out] stats statistics to update.
+ * @param cycles cycles spent, or 0 if the thread formatted nothing.
+ *
+ * **Effects**: writes `*stats`.
+ */
+static void count_format(struct arr3d_stats *stats, uint64_t cycles) {
+    if (cycles == 0)
+        return;
+    stats->format_cycles += cycles;
+    if (cycles > stats->format_max_cycles)
+        stats->format_max_cycles = cycles;
+    stats->format_threads++;
+}
+
+/** Multiply `size_t`s, checking for overflow.
+ *
+ * @param a first factor.
+ * @param b second factor.
+ * @param[out] r pointer to store the product.
+ *
+ * @return if the product fits into a `size_t`.
+ *
+ * **Effects**: writes `*r` if the product fits.
+ */
+static bool size_mul(size_t a, size_t b, size_t *r) {
+    if (b != 0 && a > SIZE_MAX / b)
+        return false;
+    *r = a * b;
+    return true;
+}
+
+/** Add `size_t`s, checking for overflow.
+ *
+ * @param a first summand.
+ * @param b second summand.
+ * @param[out] r pointer to store the sum.
+ *
+ * @return if the sum fits into a `size_t`.
+ *
+ * **Effects**: writes `*r` if the sum fits.
+ */
+static bool size_add(size_t a, size_t b, size_t *r) {
+    if (a > SIZE_MAX - b)
+        return false;
+    *r = a + b;
+    return true;
+}
+
+/** Alignment of blocks carved out of an arena. */
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+/** Bump allocator carving blocks out of one block of fixed length. */
+struct arena {
+    /** Backing block. */
+    char *base;
+    /** Mapping of `base`, or NULL. */
+    void *map;
+    /** Length of `map` in bytes. */
+    size_t map_len;
+    /** Length of `base` in bytes. */
+    size_t len;
+    /** Number of bytes of `base` handed out, shared by all threads. */
+    atomic_size_t used;
+};
+
+/** Round length up to a multiple of `ARENA_ALIGN`, checking for overflow.
+ *
+ * @param len length to round.
+ * @param[out] r pointer to store the rounded length.
+ *
+ * @return if the rounded length fits into a `size_t`.
+ *
+ * **Effects**: writes `*r` if it fits.
+ */
+static bool arena_round(size_t len, size_t *r) {
+    if (len > SIZE_MAX - (ARENA_ALIGN - 1))
+        return false;
+    *r = (len + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    return true;
+}
+
+/** `alloc` of an arena allocator.
+ *
+ * Blocks are handed out in the order they are asked for, so that a serially
+ * built tree lies in the arena in the order it is traversed.
+ */
+static void *arena_alloc(void *ctx, size_t len) {
+    struct arena *arena = ctx;
+    size_t rounded;
+    if (!arena_round(len, &rounded) || rounded > arena->len) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t used = atomic_load_explicit(&arena->used, memory_order_relaxed);
+    do {
+        if (rounded > arena->len - used) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        &arena->used, &used, used + rounded, memory_order_relaxed,
+        memory_order_relaxed));
+    return arena->base + used;
+}
+
+/** `free` of an arena allocator, which frees nothing before `release`. */
+static void arena_free(void *ctx, void *ptr) {
+    (void)ctx;
+    (void)ptr;
+}
+
+/** `release` of an arena allocator. */
+static void arena_release(void *ctx) {
+    struct arena *arena = ctx;
+    free_block(arena->base, arena->map, arena->map_len);
+    free(arena);
+}
+
+/** Compute length of an arena large enough for a pointer tree.
+ *
+ * @param x size of the first layer of the tree.
+ * @param y size of each second layer of the tree.
+ * @param z size of each third layer of the tree.
+ * @param[out] len pointer to store the length in bytes.
+ *
+ * @return if the length fits into a `size_t`.
+ *
+ * **Effects**: writes `*len` if it fits.
+ */
+static bool arena_len(size_t x, size_t y, size_t z, size_t *len) {
+    // One top table, x tables of y row pointers, x*y rows of z elements
+    size_t top, tables, rows;
+    return size_mul(x, sizeof(elem **), &top) && arena_round(top, &top) &&
+           size_mul(y, sizeof(elem *), &tables) &&
+           arena_round(tables, &tables) && size_mul(tables, x, &tables) &&
+           size_mul(z, sizeof(elem), &rows) && arena_round(rows, &rows) &&
+           size_mul(rows, x, &rows) && size_mul(rows, y, &rows) &&
+           size_add(top, tables, len) && size_add(*len, rows, len);
+}
+
+/** Create arena allocator large enough for a pointer tree.
+ *
+ * @param[out] alloc allocator to initialize.
+ * @param x size of the first layer of the tree.
+ * @param y size of each second layer of the tree.
+ * @param z size of each third layer of the tree.
+ * @param backing allocation policy of the arena.
+ *
+ * @return if allocation was successful, otherwise `errno` is set.
+ *
+ * **Effects**: allocates, writes `*alloc`, may write `errno`.
+ */
+static bool mk_arena(struct allocator *alloc, size_t x, size_t y, size_t z,
+                     enum arr3d_backing backing) {
+    size_t len;
+    if (!arena_len(x, y, z, &len)) {
+        errno = ENOMEM;
+        return false;
+    }
+    struct arena *arena = malloc(sizeof(struct arena));
+    if (arena == NULL)
+        return false;
+    arena->base = alloc_block(len, backing, &arena->map, &arena->map_len);
+    if (arena->base == NULL) {
+        free(arena);
+        return false;
+    }
+    arena->len = len;
+    atomic_init(&arena->used, 0);
+    *alloc = (struct allocator){
+        .alloc = arena_alloc,
+        .free = arena_free,
+        .release = arena_release,
+        .ctx = arena,
+    };
+    return true;
+}
+
+/** Free subarrays from including arr[from] up to excluding arr[to].
+ *
+ * @param arr array to free.
+ * @param from index of first element of `arr` to free.
+ * @param to index past the last element of `arr` to free.
+ * @param y size of elements of `arr`.
+ * @param alloc allocator of `arr`.
+ *
+ * @pre
+ * - (1) for all `from <= i_ < to`, `arr[i_]` is defined and allocated.
+ * - (2) for all `from <= i_ < to`, `j < y`, `arr[i_][j]` is defined and
+ *   allocated.
+ *
+ * **Frees**
+ * - `arr[i_]` for `i_` in (1).
+ * - `arr[i_][j]` for `i_`, `j` in (2).
+ *
+ * Effects: frees some pointers derived from `arr`.
+ */
+static void free_sub_arr_between(elem ***arr, size_t from, size_t to,
+                                 size_t y, const struct allocator *alloc) {
+    for (size_t i_ = from; i_ < to; i_++) {
+        for (size_t j = 0; j < y; j++)
+            alloc->free(alloc->ctx, arr[i_][j]);
+        alloc->free(alloc->ctx, arr[i_]);
+    }
+}
+
+/** Free subarrays up to excluding arr[i].
+ *
+ * @param arr array to free.
+ * @param i index of latest element of `arr` for which allocation has begun,
+ * or the size of `arr` if allocation is finished.
+ * @param y size of elements of `arr`.
+ * @param alloc allocator of `arr`.
+ *
+ * @pre
+ * - (1) for all `i_ < i`, `arr[i_]` is defined and allocated.
+ * - (2) for all `i_ < i`, `j < y`, `arr[i_][j]` is defined and allocated.
+ *
+ * **Correctness conditions**
+ * - in (1), these are the only such `i_`.
+ * - in (2), these are the only such `i_`, `j`.
+ *
+ * **Frees**
+ * - `arr[i_]` for `i_` in (1).
+ * - `arr[i_][j]` for `i_`, `j` in (2).
+ *
+ * Effects: frees some pointers derived from `arr`.
+ */
+static void free_sub_arr_up_to(elem ***arr, size_t i, size_t y,
+                               const struct allocator *alloc) {
+    free_sub_arr_between(arr, 0, i, y, alloc);
+}
+
+/** Free partially allocated subarray.
+ *
+ * @param sub subarray to free, or NULL.
+ * @param j index of latest element of `sub` for which allocation has begun.
+ * @param alloc allocator of `sub`.
+ *
+ * @pre
+ * - (1) for all `j_ < j`, `sub[j_]` is defined and allocated.
+ * - `sub` is NULL or allocated.
+ *
+ * **Correctness conditions**
+ * - if `sub` is NULL, `j == 0`.
+ * - in (1), these are the only such `j_`.
+ *
+ * **Frees**
+ * - `sub`.
+ * - `sub[j_]` for `j_` in (1).
+ *
+ * **Effects**: frees `sub` and all valid pointers derived from it.
+ */
+static void free_partial_sub_arr(elem **sub, size_t j,
+                                 const struct allocator *alloc) {
+    for (size_t j_ = 0; j_ < j; j_++)
+        alloc->free(alloc->ctx, sub[j_]);
+    alloc->free(alloc->ctx, sub);
+}
+
+/** Free completely allocated array.
+ *
+ * If `alloc` can release all its blocks at once, it is released instead.
+ *
+ * @param arr array to free.
+ * @param x size of `arr`.
+ * @param y size of elements of `arr`.
+ * @param alloc allocator of `arr`.
+ *
+ * @pre
+ * - (1) for all `i < x`, `arr[i]` is defined and allocated.
+ * - (2) for all `i < x`, `j < y, arr[i][j]` is defined and allocated.
+ * - `arr` is allocated.
+ *
+ * **Correctness conditions**
+ * - in (1), these are the only such `i`.
+ * - in (2), these are the only such `i`, `j`.
+ *
+ * **Frees**
+ * - `arr[i]` for `i` in (1).
+ * - `arr[i][j]` for `i`, `j` in (2).
+ *
+ * **Effects**: frees arr and all valid pointers derived from it.
+ */
+static void free_complete_arr(elem ***arr, size_t x, size_t y,
+                              const struct allocator *alloc) {
+    if (alloc->release != NULL) {
+        alloc->release(alloc->ctx);
+        return;
+    }
+    free_sub_arr_up_to(arr, x, y, alloc);
+    alloc->free(alloc->ctx, arr);
+}
+
+/** Free incomplete array.
+ *
+ * If `alloc` can release all its blocks at once, it is released instead.
+ *
+ * @param arr array to free.
+ * @param y size of elements of arr.
+ * @param i index of latest element of arr for which allocation has begun.
+ * @param j index of latest element of `arr[i]` for which allocation has
+ * begun, or y if allocation of that subarray is finished.
+ * @param alloc allocator of `arr`.
+ *
+ * @pre
+ * - (1) for all `i_ < i`, `arr[i_]` is defined and allocated.
+ * - (2) for all `i_ < i`, `j_ < y`, `arr[i_][j_]` is defined and allocated.
+ * - (3) for all `j_ < j`, `arr[i][j_]` is defined and allocated.
+ * - `arr` is allocated.
+ *
+ * **Correctness conditions**
+ * - in (1), these are the only such `i_`.
+ * - in (2), these are the only such `i_`, `j_`.
+ * - in (3), these are the only such `j_`.
+ *
+ * **Frees**
+ * - `arr`
+ * - `arr[i_]` for `i_` in (1).
+ * - `arr[i_][j_]` for `i_`, `j_` in (2).
+ * - `arr[i][j_]` for `j_` in (3).
+ *
+ * **Effects**: frees `arr` and all valid pointers derived from it.
+ */
+static void free_incomplete_arr(elem ***arr, size_t y, size_t i, size_t j,
+                                const struct allocator *alloc) {
+    if (alloc->release != NULL) {
+        alloc->release(alloc->ctx);
+        return;
+    }
+    free_sub_arr_up_to(arr, i, y, alloc);
+    free_partial_sub_arr(arr[i], j, alloc);
+    alloc->free(alloc->ctx, arr);
+}
+
+/** Free array.
+ *
+ * @param arr array to free.
+ *
+ * @pre
+ * `arr` was initialized by `mk_arr` and not freed since.
+ *
+ * **Effects**: frees all storage owned by `arr`.
+ */
+static void free_arr(struct arr *arr) {
+    if (arr->layout == ARR3D_LAYOUT_TREE) {
+        free_complete_arr(arr->tree, arr->x, arr->y, &arr->alloc);
+        return;
+    }
+    free(arr->powers);
+    free(arr->tree);
+    free(arr->rows);
+    free_block(arr->flat, arr->map, arr->map_len);
+}
+
+/** Check if the host stores integers little-endian.
+ *
+ * @return if the host is little-endian.
+ */
+static bool is_little_endian(void) {
+    const elem one = 1;
+    return *(const unsigned char *)&one == 1;
+}
+
+/** Copy elements as little-endian bytes.
+ *
+ * @param[out] dst buffer of at least `n * sizeof(elem)` bytes.
+ * @param src elements to copy.
+ * @param n number of elements to copy.
+ *
+ * **Effects**: writes `dst`.
+ */
+static void copy_le(char *dst, const elem *src, size_t n) {
+    if (is_little_endian()) {
+        memcpy(dst, src, n * sizeof(elem));
+        return;
+    }
+    for (size_t e = 0; e < n; e++) {
+        elem v = src[e];
+        for (size_t b = 0; b < sizeof(elem); b++) {
+            *dst++ = (char)(v & UCHAR_MAX);
+            v >>= CHAR_BIT;
+        }
+    }
+}
+
+/** Format NumPy `.npy` version 1.0 header for array.
+ *
+ * The header describes a C-order array of shape `(x, y, z)` of little-endian
+ * unsigned integers, and is padded to a multiple of 64 bytes.
+ *
+ * @param arr array to describe.
+ * @param[out] dst buffer of at least `NPY_HEADER_LEN` bytes.
+ *
+ * @return number of bytes written to `dst`, or 0 if `elem` has a size NumPy
+ * has no unsigned integer type for.
+ *
+ * **Effects**: writes `dst`.
+ */
+static size_t format_npy_header(const struct arr *arr, char *dst) {
+    if (sizeof(elem) != 1 && sizeof(elem) != 2 && sizeof(elem) != 4 &&
+        sizeof(elem) != 8)
+        return 0;
+    // Magic string, version 1.0, and space for the header length
+    memcpy(dst, "\x93NUMPY\x01\x00\x00\x00", 10);
+    int len = snprintf(dst + 10, NPY_HEADER_LEN - 10,
+                       "{'descr': '<u%zu', 'fortran_order': False, "
+                       "'shape': (%zu, %zu, %zu), }",
+                       sizeof(elem), arr->x, arr->y, arr->z);
+    size_t total = (10 + (size_t)len + 1 + 63) / 64 * 64;
+    memset(dst + 10 + len, ' ', total - 10 - (size_t)len - 1);
+    dst[total - 1] = '\n';
+    dst[8] = (char)((total - 10) & 0xff);
+    dst[9] = (char)((total - 10) >> 8);
+    return total;
+}
+
+/** Calculate `x` to the `y`-th power using exponentiation by squaring.
+ *
+ * @param x base of exponentiation.
+ * @param y exponent.
+ */
+static elem elem_pow(elem x, size_t y) {
+    elem result = 1;
+    while (true) {
+        if ((y & 1) == 1)
+            result *= x;
+        y >>= 1;
+        if (y == 0)
+            break;
+        x *= x;
+    }
+    return result;
+}
+
+/** First three prime numbers, one per dimension of the array. */
+static const elem dim_base[3] = {2, 3, 5};
+
+/** Get original index of selected index of array.
+ *
+ * @param arr array to index.
+ * @param d dimension.
+ * @param a selected index into dimension `d`.
+ *
+ * @return original index.
+ */
+static size_t box_index(const struct arr *arr, size_t d, size_t a) {
+    return arr->box[d].start + a * arr->box[d].step;
+}
+
+/** Get factor of element of array contributed by one dimension.
+ *
+ * @param arr array to index.
+ * @param d dimension.
+ * @param a selected index into dimension `d`.
+ *
+ * @return `dim_base[d]` to the power of the original index.
+ */
+static elem dim_pow(const struct arr *arr, size_t d, size_t a) {
+    return elem_pow(dim_base[d], box_index(arr, d, a));
+}
+
+/** Get ratio of consecutive elements of array along one dimension.
+ *
+ * @param arr array to index.
+ * @param d dimension.
+ *
+ * @return `dim_base[d]` to the power of the step of dimension `d`.
+ */
+static elem dim_ratio(const struct arr *arr, size_t d) {
+    return elem_pow(dim_base[d], arr->box[d].step);
+}
+
+/** Get number of selected indices of a dimension.
+ *
+ * @param range selected indices.
+ *
+ * @return number of selected indices.
+ *
+ * @pre
+ * `range->step > 0`.
+ */
+static size_t range_len(const struct arr3d_range *range) {
+    if (range->start >= range->stop)
+        return 0;
+    return (range->stop - range->start - 1) / range->step + 1;
+}
+
+#if defined(__GNUC__) && !defined(ELEM_U128)
+/** Number of elements per vector of `fill_geometric`. */
+#define FILL_LANES 8
+
+/** Vector of `FILL_LANES` elements. */
+typedef elem fill_vec __attribute__((vector_size(FILL_LANES * sizeof(elem))));
+#endif
+
+#if defined(FILL_LANES) && defined(__x86_64__)
+/** Clone for AVX-512, AVX2 and baseline SSE2, picked at load time. */
+#define FILL_TARGETS                                                           \
+    __attribute__((target_clones("arch=x86-64-v4", "avx2", "default")))
+#else
+/** No clones, the target's own vector instructions are used. */
+#define FILL_TARGETS
+#endif
+
+/** Write geometric progression.
+ *
+ * If vector extensions are available, two vectors of `FILL_LANES`
+ * consecutive elements are stored per step and multiplied lane-wise by
+ * `ratio^(2 * FILL_LANES)`. The remaining elements are written by a scalar
+ * loop.
+ *
+ * @param[out] row buffer of at least `n` elements to write.
+ * @param v value of the first element.
+ * @param ratio ratio of consecutive elements.
+ * @param n number of elements to write.
+ *
+ * **Effects**: writes `row[k]` for all `k < n`.
+ */
+FILL_TARGETS static void fill_geometric(elem *row, elem v, elem ratio,
+                                        size_t n) {
+    size_t k = 0;
+#ifdef FILL_LANES
+    if (n >= 2 * FILL_LANES) {
+        fill_vec lo, hi;
+        for (size_t l = 0; l < FILL_LANES; l++, v *= ratio)
+            lo[l] = v;
+        for (size_t l = 0; l < FILL_LANES; l++, v *= ratio)
+            hi[l] = v;
+        const elem step = elem_pow(ratio, 2 * FILL_LANES);
+        for (; k + 2 * FILL_LANES <= n; k += 2 * FILL_LANES) {
+            memcpy(row + k, &lo, sizeof(lo));
+            memcpy(row + k + FILL_LANES, &hi, sizeof(hi));
+            lo *= step;
+            hi *= step;
+        }
+        v = lo[0];
+    }
+#endif
+    for (; k < n; k++) {
+        row[k] = v;
+        v *= ratio;
+    }
+}
+
+/** Initialize part of row of array.
+ *
+ * Sets `row[k_]` to element `[i][j][k + k_]` of `arr`. The first element is
+ * computed once, and the rest by `fill_geometric`.
+ *
+ * @param arr array whose selected indices to use.
+ * @param[out] row buffer of at least `n` elements to initialize.
+ * @param i index into the first layer.
+ * @param j index into the second layer.
+ * @param k index into the third layer of the first element.
+ * @param n number of elements to initialize.
+ *
+ * **Effects**: writes `row[k_]` for all `k_ < n`.
+ */
+static void fill_row(const struct arr *arr, elem *row, size_t i, size_t j,
+                     size_t k, size_t n) {
+    fill_geometric(row,
+                   dim_pow(arr, 0, i) * dim_pow(arr, 1, j) * dim_pow(arr, 2, k),
+                   dim_ratio(arr, 2), n);
+}
+
+/** Initialize range of elements of array in row-major order.
+ *
+ * The range may span any number of rows. The starting value of each row is
+ * carried over from the previous one instead of being recomputed. Shapes
+ * with rows of one element collapse to one progression per first layer
+ * index, or to a single progression if `y` is 1 as well.
+ *
+ * @param arr array whose shape and selected indices to use.
+ * @param[out] dst buffer of at least `n` elements to initialize.
+ * @param e index of the first element, in row-major order.
+ * @param n number of elements to initialize.
+ *
+ * @pre
+ * `e + n <= arr->x * arr->y * arr->z`.
+ *
+ * **Effects**: writes `dst[e_]` for all `e_ < n`.
+ */
+static void fill_block(const struct arr *arr, elem *dst, size_t e, size_t n) {
+    if (n == 0)
+        return;
+    size_t y = arr->y, z = arr->z;
+    size_t r = e / z, k = e % z;
+    size_t i = r / y, j = r % y;
+    elem r2 = dim_ratio(arr, 0), r3 = dim_ratio(arr, 1);
+    elem r5 = dim_ratio(arr, 2);
+    elem vi = dim_pow(arr, 0, i) * dim_pow(arr, 2, 0);
+    if (z == 1 && y == 1) {
+        fill_geometric(dst, vi * dim_pow(arr, 1, 0), r2, n);
+        return;
+    }
+    elem vij = vi * dim_pow(arr, 1, j);
+    while (n > 0) {
+        if (z == 1) {
+            // One element per row, so each first layer index is a progression
+            size_t len = y - j < n ? y - j : n;
+            fill_geometric(dst, vij, r3, len);
+            dst += len;
+            n -= len;
+        } else {
+            size_t len = z - k < n ? z - k : n;
+            fill_geometric(dst, k == 0 ? vij : vij * elem_pow(r5, k), r5,
+                           len);
+            dst += len;
+            n -= len;
+            k = 0;
+            if (++j < y) {
+                vij *= r3;
+                continue;
+            }
+        }
+        j = 0;
+        vi *= r2;
+        vij = vi * dim_pow(arr, 1, 0);
+    }
+}
+
+/** Compute part of row of lazy array from its powers of 5.
+ *
+ * @param pow5 powers `5^(k + k_)` for all `k_ < n`.
+ * @param ij product of the powers of 2 and 3 of the row.
+ * @param n number of elements to compute.
+ * @param[out] row buffer of at least `n` elements to write.
+ *
+ * **Effects**: writes `row[k_]` for all `k_ < n`.
+ */
+FILL_TARGETS static void lazy_row(const elem *pow5, elem ij, size_t n,
+                                  elem *row) {
+    for (size_t k_ = 0; k_ < n; k_++)
+        row[k_] = ij * pow5[k_];
+}
+
+/** Get part of row of array.
+ *
+ * @param arr array to index.
+ * @param i index into the first layer.
+ * @param j index into the second layer.
+ * @param k index into the third layer of the first element.
+ * @param n number of elements.
+ * @param[out] scratch buffer of at least `n` elements to generate the
+ * elements into in `ARR3D_LAYOUT_STREAM` and `ARR3D_LAYOUT_LAZY`, unused
+ * otherwise.
+ *
+ * @return pointer to the `n` consecutive elements `arr[i][j][k + k_]`.
+ *
+ * @pre
+ * `i < arr->x`, `j < arr->y`, `k + n <= arr->z`.
+ *
+ * **Effects**: may write `scratch`.
+ */
+static const elem *arr_row_part(const struct arr *arr, size_t i, size_t j,
+                                size_t k, size_t n, elem *scratch) {
+    switch (arr->layout) {
+    case ARR3D_LAYOUT_TREE:
+        return arr->tree[i][j] + k;
+    case ARR3D_LAYOUT_FLAT:
+        return arr->flat + (i * arr->y + j) * arr->z + k;
+    case ARR3D_LAYOUT_STREAM:
+        break;
+    case ARR3D_LAYOUT_LAZY:
+        lazy_row(arr->powers + arr->x + arr->y + k,
+                 arr->powers[i] * arr->powers[arr->x + j], n, scratch);
+        return scratch;
+    }
+    fill_row(arr, scratch, i, j, k, n);
+    return scratch;
+}
+
+/** Get range of elements of array in row-major order.
+ *
+ * The range may span any number of rows. A contiguous array is read in
+ * place, and so is a range within one row of a tree. Otherwise the elements
+ * are gathered or generated into `scratch`, rows of a stream array by one
+ * `fill_block`.
+ *
+ * @param arr array to index.
+ * @param e index of the first element, in row-major order.
+ * @param n number of elements.
+ * @param[out] scratch buffer of at least `n` elements, unused in
+ * `ARR3D_LAYOUT_FLAT`.
+ *
+ * @return pointer to the `n` consecutive elements starting at `e`.
+ *
+ * @pre
+ * `0 < n`, `e + n <= arr->x * arr->y * arr->z`.
+ *
+ * **Effects**: may write `scratch`.
+ */
+static const elem *arr_block(const struct arr *arr, size_t e, size_t n,
+                             elem *scratch) {
+    size_t y = arr->y, z = arr->z;
+    if (arr->layout == ARR3D_LAYOUT_FLAT)
+        return arr->flat + e;
+    if (arr->layout == ARR3D_LAYOUT_STREAM) {
+        fill_block(arr, scratch, e, n);
+        return scratch;
+    }
+    size_t r = e / z, k = e % z;
+    if (z - k >= n)
+        return arr_row_part(arr, r / y, r % y, k, n, scratch);
+    for (size_t done = 0; done < n; r++, k = 0) {
+        size_t len = z - k < n - done ? z - k : n - done;
+        const elem *row =
+            arr_row_part(arr, r / y, r % y, k, len, scratch + done);
+        if (row != scratch + done)
+            memcpy(scratch + done, row, len * sizeof(elem));
+        done += len;
+    }
+    return scratch;
+}
+
+/** Allocate scratch buffer for reading parts of rows of array.
+ *
+ * @param arr array to be read.
+ * @param n maximal number of elements read at once.
+ * @param[out] scratch pointer to store the allocated buffer, or NULL if
+ * `arr` stores its elements contiguously.
+ *
+ * @return if allocation was successful.
+ *
+ * **Effects**: may allocate, writes `*scratch`, may write `errno`.
+ */
+static bool alloc_scratch(const struct arr *arr, size_t n, elem **scratch) {
+    *scratch = NULL;
+    if (arr->layout == ARR3D_LAYOUT_FLAT)
+        return true;
+    *scratch = malloc(n * sizeof(elem));
+    return *scratch != NULL;
+}
+
+/** Part of the population of an array handled by one worker. */
+struct fill_job {
+    /** Array to populate. */
+    struct arr *arr;
+    /**
+     * First index handled, into the first layer in `ARR3D_LAYOUT_TREE`, or into
+     * the `x * y` rows in `ARR3D_LAYOUT_FLAT`.
+     */
+    size_t begin;
+    /** Index past the last one handled. */
+    size_t end;
+    /** Number of indices split among all jobs. */
+    size_t n;
+    /** Job function run by `run_fill_job`. */
+    void *(*fn)(void *);
+    /** Flag shared by all jobs, set once any of them fails. */
+    atomic_bool *failed;
+    /** Allocation statistics of the job. */
+    struct arr3d_stats stats;
+    /**
+     * In `ARR3D_LAYOUT_TREE`, index of the first element of `arr->tree` in the
+     * range which is not completely allocated. If it is below `end`,
+     * `arr->tree[i]` is allocated or NULL.
+     */
+    size_t i;
+    /** Number of allocated elements of `arr->tree[i]`, if `i < end`. */
+    size_t j;
+    /** `errno` of the failed allocation, or 0. */
+    int err;
+    /** Thread running the job. */
+    pthread_t thread;
+    /** Whether the job runs on `thread`. */
+    bool threaded;
+};
+
+/** Allocate and initialize some subarrays of a pointer tree.
+ *
+ * Stops early when `*job->failed` is set.
+ *
+ * @param arg `struct fill_job` to run.
+ *
+ * @return NULL.
+ *
+ * @pre
+ * `job->arr->tree` is allocated with at least `job->end` elements.
+ *
+ * **Effects**: allocates from `job->arr->alloc`, writes `*job`, writes
+ * `job->arr->tree[i]` for some `job->begin <= i < job->end`, may write
+ * `*job->failed`.
+ *
+ * @post
+ * - for all `job->begin <= i_ < job->i`, `j < y`, `k < z`,
+ *   `job->arr->tree[i_][j][k]` is defined.
+ * - if `job->i < job->end`, the job did not finish, and
+ *   `job->arr->tree[job->i]` is allocated or NULL, with its first `job->j`
+ *   elements allocated.
+ */
+static void *fill_tree_job(void *arg) {
+    struct fill_job *job = arg;
+    elem ***arr = job->arr->tree;
+    size_t y = job->arr->y, z = job->arr->z;
+    const struct allocator *alloc = &job->arr->alloc;
+    for (job->i = job->begin; job->i < job->end; job->i++) {
+        size_t i = job->i;
+        job->j = 0;
+        if (atomic_load_explicit(job->failed, memory_order_relaxed)) {
+            arr[i] = NULL;
+            return NULL;
+        }
+        arr[i] = counted_alloc(job->arr, alloc, y * sizeof(elem *),
+                               &job->stats, &job->stats.table_bytes);
+        if (arr[i] == NULL)
+            goto fail;
+        for (; job->j < y; job->j++) {
+            size_t j = job->j;
+            arr[i][j] = counted_alloc(job->arr, alloc, z * sizeof(elem),
+                                      &job->stats, &job->stats.elem_bytes);
+            if (arr[i][j] == NULL)
+                goto fail;
+            fill_row(job->arr, arr[i][j], i, j, 0, z);
+        }
+    }
+    return NULL;
+fail:
+    job->err = errno;
+    atomic_store(job->failed, true);
+    return NULL;
+}
+
+/** Initialize some rows of a contiguous array.
+ *
+ * @param arg `struct fill_job` to run.
+ *
+ * @return NULL.
+ *
+ * @pre
+ * - `job->arr->flat` is allocated with at least `job->end * z` elements.
+ * - `job->arr->tree`, if not NULL, is a view with `tree[i]` defined for all
+ *   `i < x`.
+ *
+ * **Effects**: writes rows `job->begin` to excluding `job->end` of
+ * `job->arr->flat`, and the corresponding view pointers.
+ */
+static void *fill_flat_job(void *arg) {
+    struct fill_job *job = arg;
+    struct arr *arr = job->arr;
+    size_t y = arr->y, z = arr->z;
+    if (arr->tree != NULL)
+        for (size_t r = job->begin; r < job->end; r++)
+            arr->tree[r / y][r % y] = arr->flat + r * z;
+    fill_block(arr, arr->flat + job->begin * z, job->begin * z,
+               (job->end - job->begin) * z);
+    return NULL;
+}
+
+/** Run fill job placed next to its part of the array.
+ *
+ * @param arg `struct fill_job` to run.
+ *
+ * @return NULL.
+ *
+ * **Effects**: runs `job->fn` on `job`, may change and then restores the
+ * placement of the calling thread, may write `job->stats`.
+ */
+static void *run_fill_job(void *arg) {
+    struct fill_job *job = arg;
+    struct placement saved;
+    if (job->begin < job->end)
+        numa_place(&job->arr->numa, job->begin, job->n, &saved);
+    else
+        saved = (struct placement){.pinned = false, .interleaved = false};
+    if (job->arr->count_cycles) {
+        uint64_t start = now_cycles();
+        job->fn(job);
+        job->stats.fill_cycles = job->stats.fill_max_cycles =
+            now_cycles() - start;
+        job->stats.fill_threads = 1;
+    } else {
+        job->fn(job);
+    }
+    numa_restore(&saved);
+    return NULL;
+}
+
+/** Split range of indices among jobs and run them.
+ *
+ * Jobs run on their own threads, except for the first one, which runs on the
+ * calling thread, and any for which no thread could be created. Each is
+ * placed next to its part of the array by `run_fill_job`.
+ *
+ * @param arr array to populate.
+ * @param n number of indices to split.
+ * @param njobs number of jobs to split `n` into.
+ * @param[out] jobs jobs to initialize and run.
+ * @param[out] failed flag to share among `jobs`.
+ * @param fn job function.
+ *
+ * @pre
+ * - `njobs > 0`.
+ * - `jobs` has at least `njobs` elements.
+ *
+ * **Effects**: writes `jobs[w]` for all `w < njobs`, writes `*failed`, runs
+ * `fn` on each of them, may create threads.
+ *
+ * @post
+ * all jobs have finished.
+ */
+static void run_fill_jobs(struct arr *arr, size_t n, size_t njobs,
+                          struct fill_job *jobs, atomic_bool *failed,
+                          void *(*fn)(void *)) {
+    atomic_init(failed, false);
+    for (size_t w = 0; w < njobs; w++) {
+        size_t extra = n % njobs;
+        jobs[w] = (struct fill_job){
+            .arr = arr,
+            .begin = w * (n / njobs) + (w < extra ? w : extra),
+            .end = (w + 1) * (n / njobs) + (w + 1 < extra ? w + 1 : extra),
+            .n = n,
+            .fn = fn,
+            .failed = failed,
+        };
+    }
+    for (size_t w = 1; w < njobs; w++)
+        jobs[w].threaded = pthread_create(&jobs[w].thread, NULL, run_fill_job,
+                                          &jobs[w]) == 0;
+    run_fill_job(&jobs[0]);
+    for (size_t w = 1; w < njobs; w++) {
+        if (jobs[w].threaded)
+            pthread_join(jobs[w].thread, NULL);
+        else
+            run_fill_job(&jobs[w]);
+    }
+}
+
+/** Allocate jobs for population of an array.
+ *
+ * @param jobs desired number of jobs.
+ * @param n number of indices to split among them.
+ * @param[out] njobs pointer to store number of jobs.
+ *
+ * @return allocated array of `*njobs` jobs, or NULL.
+ *
+ * **Effects**: allocates, writes `*njobs`, may write `errno`.
+ */
+static struct fill_job *mk_fill_jobs(size_t jobs, size_t n, size_t *njobs) {
+    *njobs = jobs < n ? jobs : n == 0 ? 1 : n;
+    return calloc(*njobs, sizeof(struct fill_job));
+}
+
+/** Allocate and initialize 3D array as a pointer tree.
+ *
+ * Each job allocates the subarrays it initializes, so their pages are first
+ * touched by the thread that fills them. If any allocation fails, all jobs
+ * stop, and everything allocated by any of them is freed.
+ *
+ * With `ARR3D_TREE_ALLOC_ARENA`, the top table, then the tables and rows are
+ * carved out of one block sized up front, so that they lie next to each
+ * other, and the whole tree is freed at once. The statistics still count
+ * each table and row.
+ *
+ * @param[out] arr array to initialize.
+ * @param opts options selecting the allocation policy and the number of
+ * parallel jobs.
+ * @param[in,out] stats zeroed statistics to update.
+ *
+ * @return `ARR3D_OK`, `ARR3D_JOBS` or `ARR3D_ALLOC`.
+ *
+ * @pre
+ * `arr->x`, `arr->y`, `arr->z` are defined.
+ *
+ * **Effects**: allocates, writes `*arr`, writes `*stats`, may create
+ * threads, may write `errno`.
+ *
+ * @post
+ * on success, `arr->layout == ARR3D_LAYOUT_TREE`, and for all `i < x`, `j < y`,
+ * `k < z`, `arr->tree[i][j][k]` is defined. On failure, nothing is
+ * allocated.
+ */
+static enum arr3d_status mk_tree_arr(struct arr *arr,
+                                     const struct arr3d_opts *opts,
+                                     struct arr3d_stats *stats) {
+    size_t x = arr->x, y = arr->y;
+    arr->layout = ARR3D_LAYOUT_TREE;
+    arr->powers = NULL;
+    arr->rows = NULL;
+    arr->flat = NULL;
+    arr->map = NULL;
+    size_t njobs;
+    struct fill_job *fill_jobs = mk_fill_jobs(opts->jobs, x, &njobs);
+    if (fill_jobs == NULL)
+        return ARR3D_JOBS;
+    arr->alloc = malloc_allocator;
+    if (opts->tree_alloc == ARR3D_TREE_ALLOC_ARENA) {
+        uint64_t start = alloc_clock(arr);
+        bool ok = mk_arena(&arr->alloc, x, y, arr->z, opts->backing);
+        if (arr->time_allocs)
+            stats->alloc_ns += now_ns() - start;
+        if (!ok) {
+            int err = errno;
+            free(fill_jobs);
+            errno = err;
+            return ARR3D_ALLOC;
+        }
+        stats->arena_bytes = ((const struct arena *)arr->alloc.ctx)->len;
+    }
+    const struct allocator *alloc = &arr->alloc;
+    arr->tree = counted_alloc(arr, alloc, x * sizeof(elem **), stats,
+                              &stats->table_bytes);
+    if (arr->tree == NULL) {
+        int err = errno;
+        uint64_t start = now_ns();
+        if (alloc->release != NULL)
+            alloc->release(alloc->ctx);
+        stats->unwind_ns = now_ns() - start;
+        free(fill_jobs);
+        errno = err;
+        return ARR3D_ALLOC;
+    }
+    atomic_bool failed;
+    run_fill_jobs(arr, x, njobs, fill_jobs, &failed, fill_tree_job);
+    int err = 0;
+    for (size_t w = 0; w < njobs; w++) {
+        stats_add(stats, &fill_jobs[w].stats);
+        if (err == 0)
+            err = fill_jobs[w].err;
+    }
+    if (err != 0) {
+        uint64_t start = now_ns();
+        for (size_t w = 1; w < njobs && alloc->release == NULL; w++) {
+            struct fill_job *job = &fill_jobs[w];
+            free_sub_arr_between(arr->tree, job->begin, job->i, y, alloc);
+            if (job->i < job->end)
+                free_partial_sub_arr(arr->tree[job->i], job->j, alloc);
+        }
+        // The first job starts at 0, like a serial population would.
+        if (fill_jobs[0].i < fill_jobs[0].end)
+            free_incomplete_arr(arr->tree, y, fill_jobs[0].i, fill_jobs[0].j,
+                                alloc);
+        else
+            free_complete_arr(arr->tree, fill_jobs[0].i, y, alloc);
+        stats->unwind_ns = now_ns() - start;
+        free(fill_jobs);
+        errno = err;
+        return ARR3D_ALLOC;
+    }
+    free(fill_jobs);
+    return ARR3D_OK;
+}
+
+/** Map output file to hold binary output of array.
+ *
+ * Sizes the file to the exact length of the output, maps it, and writes the
+ * `.npy` header if requested, so that the elements can be built in place.
+ *
+ * @param[in,out] arr array whose `map`, `map_len` and `flat` to write.
+ * @param opts options selecting the output format and file descriptor.
+ *
+ * @return `ARR3D_OK`, `ARR3D_NPY`, `ARR3D_ALLOC` if allocating an empty
+ * output failed, or `ARR3D_OUTPUT_FILE` if resizing or mapping the file
+ * failed.
+ *
+ * @pre
+ * - `arr->x`, `arr->y`, `arr->z` are defined.
+ * - `opts->map_fd` is open for reading and writing.
+ *
+ * **Effects**: resizes and maps `opts->map_fd`, writes `arr->map`,
+ * `arr->map_len` and `arr->flat`, may write `errno`.
+ *
+ * @post
+ * on success, `arr->flat` is defined, and `arr->map` is NULL if the output is
+ * empty.
+ */
+static enum arr3d_status map_output(struct arr *arr,
+                                    const struct arr3d_opts *opts) {
+    char header[NPY_HEADER_LEN];
+    size_t header_len = 0;
+    if (opts->map_format == ARR3D_FORMAT_NPY) {
+        header_len = format_npy_header(arr, header);
+        if (header_len == 0)
+            return ARR3D_NPY;
+    }
+    size_t len = header_len + arr->x * arr->y * arr->z * sizeof(elem);
+    if (ftruncate(opts->map_fd, (off_t)len) != 0)
+        return ARR3D_OUTPUT_FILE;
+    if (len == 0) {
+        // An empty mapping is invalid, so fall back to an empty allocation
+        arr->flat = malloc(len);
+        return arr->flat == NULL ? ARR3D_ALLOC : ARR3D_OK;
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     opts->map_fd, 0);
+    if (map == MAP_FAILED)
+        return ARR3D_OUTPUT_FILE;
+    memcpy(map, header, header_len);
+    arr->map = map;
+    arr->map_len = len;
+    arr->flat = (elem *)((char *)map + header_len);
+    return ARR3D_OK;
+}
+
+/** Allocate and initialize 3D array as one contiguous block.
+ *
+ * The block is allocated up front, and the jobs each initialize a range of
+ * rows of it, so their pages are first touched by the thread that fills them.
+ *
+ * @param[out] arr array to initialize.
+ * @param opts options selecting whether to also build a row pointer view into
+ * the block, the number of parallel jobs and the output file to map.
+ * @param[in,out] stats zeroed statistics to update.
+ *
+ * @return `ARR3D_OK`, `ARR3D_JOBS`, `ARR3D_ALLOC`, `ARR3D_NPY` or
+ * `ARR3D_OUTPUT_FILE`.
+ *
+ * @pre
+ * `arr->x`, `arr->y`, `arr->z` are defined.
+ *
+ * **Effects**: allocates, writes `*arr`, writes `*stats`, may create
+ * threads, may write `errno`.
+ *
+ * @post
+ * on success, `arr->layout == ARR3D_LAYOUT_FLAT`, and for all `i < x`, `j < y`,
+ * `k < z`, `arr->flat[(i * y + j) * z + k]` is defined. On failure, nothing
+ * is allocated.
+ */
+static enum arr3d_status mk_flat_arr(struct arr *arr,
+                                     const struct arr3d_opts *opts,
+                                     struct arr3d_stats *stats) {
+    size_t x = arr->x, y = arr->y, z = arr->z;
+    arr->layout = ARR3D_LAYOUT_FLAT;
+    arr->powers = NULL;
+    arr->tree = NULL;
+    arr->rows = NULL;
+    arr->flat = NULL;
+    arr->map = NULL;
+    size_t njobs;
+    struct fill_job *fill_jobs = mk_fill_jobs(opts->jobs, x * y, &njobs);
+    if (fill_jobs == NULL)
+        return ARR3D_JOBS;
+    enum arr3d_status status = ARR3D_OK;
+    size_t len = x * y * z * sizeof(elem);
+    uint64_t start = alloc_clock(arr);
+    if (opts->map_fd >= 0)
+        status = map_output(arr, opts);
+    else
+        arr->flat = alloc_block(len, opts->backing, &arr->map, &arr->map_len);
+    if (status == ARR3D_OK && arr->flat == NULL)
+        status = ARR3D_ALLOC;
+    count_alloc(arr, start, status == ARR3D_OK, len, stats,
+                &stats->elem_bytes);
+    if (status != ARR3D_OK) {
+        int err = errno;
+        free(fill_jobs);
+        errno = err;
+        return status;
+    }
+    if (opts->views) {
+        arr->tree = counted_alloc(arr, &malloc_allocator, x * sizeof(elem **),
+                                  stats, &stats->table_bytes);
+        arr->rows = arr->tree == NULL
+                        ? NULL
+                        : counted_alloc(arr, &malloc_allocator,
+                                        x * y * sizeof(elem *), stats,
+                                        &stats->table_bytes);
+        if (arr->rows == NULL) {
+            int err = errno;
+            start = now_ns();
+            free_arr(arr);
+            stats->unwind_ns = now_ns() - start;
+            free(fill_jobs);
+            errno = err;
+            return ARR3D_ALLOC;
+        }
+        for (size_t i = 0; i < x; i++)
+            arr->tree[i] = arr->rows + i * y;
+    }
+    atomic_bool failed;
+    run_fill_jobs(arr, x * y, njobs, fill_jobs, &failed, fill_flat_job);
+    for (size_t w = 0; w < njobs; w++)
+        stats_add(stats, &fill_jobs[w].stats);
+    free(fill_jobs);
+    if (arr->map != NULL && opts->map_fd >= 0 && !is_little_endian())
+        for (size_t e = 0; e < x * y * z; e++) {
+            elem v = arr->flat[e];
+            copy_le((char *)&arr->flat[e], &v, 1);
+        }
+    return ARR3D_OK;
+}
+
+/** Multiply `elem`s, checking for overflow.
+ *
+ * @param a first factor.
+ * @param b second factor.
+ * @param[out] r pointer to store the product.
+ *
+ * @return if the product fits into an `elem`.
+ *
+ * **Effects**: writes `*r` if the product fits.
+ */
+static bool elem_mul(elem a, elem b, elem *r) {
+    if (b != 0 && a > ELEM_MAX / b)
+        return false;
+    *r = a * b;
+    return true;
+}
+
+/** Raise `elem` to a power, checking for overflow.
+ *
+ * @param x base, at least 2.
+ * @param y exponent.
+ * @param[out] r pointer to store the power.
+ *
+ * @return if the power fits into an `elem`.
+ *
+ * **Effects**: writes `*r` if the power fits.
+ */
+static bool elem_pow_checked(elem x, size_t y, elem *r) {
+    elem result = 1;
+    // Overflows after at most `sizeof(elem) * CHAR_BIT` steps
+    for (; y > 0; y--)
+        if (!elem_mul(result, x, &result))
+            return false;
+    *r = result;
+    return true;
+}
+
+/** Find first selected element whose value does not fit into an `elem`.
+ *
+ * Values grow along each dimension, so every row overflows from some `k` on,
+ * and the search stops at the first overflowing element. With each factor
+ * being at least 2, that is reached after at most `sizeof(elem) * CHAR_BIT`
+ * steps in each dimension.
+ */
+bool arr3d_find_overflow(const struct arr3d_range box[3], size_t *i,
+                         size_t *j, size_t *k) {
+    size_t n[3], at[3] = {0, 0, 0};
+    elem ratio[3];
+    bool ratio_fits[3];
+    elem a = 1;
+    bool first_fits = true;
+    for (size_t d = 0; d < 3; d++) {
+        n[d] = range_len(&box[d]);
+        if (n[d] == 0)
+            return false;
+        elem p;
+        first_fits = first_fits && elem_pow_checked(dim_base[d], box[d].start,
+                                                    &p) &&
+                     elem_mul(a, p, &a);
+        ratio_fits[d] = elem_pow_checked(dim_base[d], box[d].step, &ratio[d]);
+    }
+    if (!first_fits)
+        goto found;
+    for (; at[0] < n[0]; at[0]++) {
+        if (at[0] > 0 && !(ratio_fits[0] && elem_mul(a, ratio[0], &a))) {
+            at[1] = at[2] = 0;
+            goto found;
+        }
+        elem b = a;
+        for (at[1] = 0; at[1] < n[1]; at[1]++) {
+            if (at[1] > 0 && !(ratio_fits[1] && elem_mul(b, ratio[1], &b))) {
+                at[2] = 0;
+                goto found;
+            }
+            elem c = b;
+            for (at[2] = 1; at[2] < n[2]; at[2]++)
+                if (!(ratio_fits[2] && elem_mul(c, ratio[2], &c)))
+                    goto found;
+        }
+    }
+    return false;
+found:
+    *i = box[0].start + at[0] * box[0].step;
+    *j = box[1].start + at[1] * box[1].step;
+    *k = box[2].start + at[2] * box[2].step;
+    return true;
+}
+
+/** Allocate and initialize power tables of lazy 3D array.
+ *
+ * @param[out] arr array to initialize.
+ * @param[in,out] stats zeroed statistics to update.
+ *
+ * @return `ARR3D_OK` or `ARR3D_ALLOC`.
+ *
+ * @pre
+ * `arr->x`, `arr->y`, `arr->z` are defined.
+ *
+ * **Effects**: allocates, writes `*arr`, writes `*stats`, may write `errno`.
+ *
+ * @post
+ * on success, `arr->layout == ARR3D_LAYOUT_LAZY`, and `arr->powers` is defined.
+ */
+static enum arr3d_status mk_lazy_arr(struct arr *arr,
+                                     struct arr3d_stats *stats) {
+    size_t x = arr->x, y = arr->y, z = arr->z, n, len;
+    arr->layout = ARR3D_LAYOUT_LAZY;
+    arr->tree = NULL;
+    arr->rows = NULL;
+    arr->flat = NULL;
+    arr->map = NULL;
+    if (!size_add(x, y, &n) || !size_add(n, z, &n) ||
+        !size_mul(n, sizeof(elem), &len)) {
+        errno = ENOMEM;
+        return ARR3D_ALLOC;
+    }
+    arr->powers = counted_alloc(arr, &malloc_allocator, len, stats,
+                                &stats->elem_bytes);
+    if (arr->powers == NULL)
+        return ARR3D_ALLOC;
+    fill_geometric(arr->powers, dim_pow(arr, 0, 0), dim_ratio(arr, 0), x);
+    fill_geometric(arr->powers + x, dim_pow(arr, 1, 0), dim_ratio(arr, 1), y);
+    fill_geometric(arr->powers + x + y, dim_pow(arr, 2, 0), dim_ratio(arr, 2),
+                   z);
+    return ARR3D_OK;
+}
+
+/** Compute storage an array will allocate, checking for overflow.
+ *
+ * Mirrors the allocations of `mk_tree_arr`, `mk_flat_arr` and
+ * `mk_lazy_arr`, so that sizes are checked once up front, and impossible
+ * shapes fail before anything is allocated.
+ *
+ * @param arr array whose dimensions to use.
+ * @param opts options selecting the storage layout and allocation policy.
+ * @param[out] plan pointer to store the allocations as statistics with
+ * zero times.
+ * @param[out] bytes pointer to store the total number of bytes, which is the
+ * length of the arena if there is one.
+ *
+ * @return if the number of elements and all sizes fit into a `size_t`.
+ *
+ * **Effects**: writes `*plan` and `*bytes` on success.
+ */
+static bool plan_arr(const struct arr *arr, const struct arr3d_opts *opts,
+                     struct arr3d_stats *plan, size_t *bytes) {
+    size_t x = arr->x, y = arr->y, z = arr->z, rows, n;
+    *plan = (struct arr3d_stats){0};
+    if (!size_mul(x, y, &rows) || !size_mul(rows, z, &n))
+        return false;
+    size_t tables = 0, row_ptrs;
+    bool tables_fit = size_mul(x, sizeof(elem **), &tables) &&
+                      size_mul(rows, sizeof(elem *), &row_ptrs) &&
+                      size_add(tables, row_ptrs, &tables);
+    if (opts->layout == ARR3D_LAYOUT_FLAT || opts->map_fd >= 0) {
+        if (!size_mul(n, sizeof(elem), &plan->elem_bytes))
+            return false;
+        plan->allocs = 1;
+        if (opts->views) {
+            if (!tables_fit)
+                return false;
+            plan->allocs += 2;
+            plan->table_bytes = tables;
+        }
+    } else if (opts->layout == ARR3D_LAYOUT_TREE) {
+        if (!tables_fit || !size_mul(n, sizeof(elem), &plan->elem_bytes) ||
+            !size_add(x, rows, &plan->allocs) ||
+            !size_add(plan->allocs, 1, &plan->allocs))
+            return false;
+        plan->table_bytes = tables;
+        if (opts->tree_alloc == ARR3D_TREE_ALLOC_ARENA &&
+            !arena_len(x, y, z, &plan->arena_bytes))
+            return false;
+    } else if (opts->layout == ARR3D_LAYOUT_LAZY) {
+        size_t powers;
+        if (!size_add(x, y, &powers) || !size_add(powers, z, &powers) ||
+            !size_mul(powers, sizeof(elem), &plan->elem_bytes))
+            return false;
+        plan->allocs = 1;
+    }
+    if (plan->arena_bytes > 0) {
+        *bytes = plan->arena_bytes;
+        return true;
+    }
+    return size_add(plan->table_bytes, plan->elem_bytes, bytes);
+}
+
+/** Allocate and initialize 3D array.
+ *
+ * @param[in,out] arr array whose dimensions to use and which to initialize.
+ * @param opts options selecting the storage layout, number of jobs and output
+ * file to map. Mapping an output file uses `ARR3D_LAYOUT_FLAT`.
+ * @param[out] stats pointer to store the allocation statistics, also on
+ * failure.
+ *
+ * @return status of `mk_flat_arr` or `mk_tree_arr`.
+ *
+ * @pre
+ * `plan_arr` succeeds for `arr` and `opts`, so that no size overflows.
+ *
+ * **Effects**: allocates, writes `*arr`, writes `*stats`, may create
+ * threads, may write `errno`.
+ *
+ * @post
+ * on success, the elements of `arr` are defined.
+ */
+static enum arr3d_status mk_arr(struct arr *arr, const struct arr3d_opts *opts,
+                                struct arr3d_stats *stats) {
+    *stats = (struct arr3d_stats){0};
+    arr->time_allocs = opts->time_allocs;
+    arr->count_cycles = opts->count_cycles;
+    if (opts->layout == ARR3D_LAYOUT_FLAT || opts->map_fd >= 0)
+        return mk_flat_arr(arr, opts, stats);
+    if (opts->layout == ARR3D_LAYOUT_TREE)
+        return mk_tree_arr(arr, opts, stats);
+    if (opts->layout == ARR3D_LAYOUT_LAZY)
+        return mk_lazy_arr(arr, stats);
+    // Nothing to allocate
+    arr->layout = ARR3D_LAYOUT_STREAM;
+    arr->powers = NULL;
+    arr->tree = NULL;
+    arr->rows = NULL;
+    arr->flat = NULL;
+    arr->map = NULL;
+    return ARR3D_OK;
+}
+
+/** Write whole buffer to file descriptor.
+ *
+ * @param fd file descriptor to write to.
+ * @param buf bytes to write.
+ * @param len number of bytes to write.
+ *
+ * @return if writing was successful.
+ *
+ * **Effects**: writes to `fd`, may write `errno`.
+ */
+static bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/** Splice whole buffer into pipe.
+ *
+ * The pipe refers to the pages of `buf` instead of copying them, until the
+ * reader has consumed them.
+ *
+ * @param fd pipe to splice into.
+ * @param buf bytes to splice.
+ * @param len number of bytes to splice.
+ *
+ * @return if splicing was successful.
+ *
+ * **Effects**: writes to `fd`, may write `errno`.
+ */
+static bool splice_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        struct iovec iov = {(void *)buf, len};
+        ssize_t n = vmsplice(fd, &iov, 1, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/** Destination of output. */
+struct sink {
+    /** File descriptor to write to. */
+    int fd;
+    /** Number of bytes written so far. */
+    size_t written;
+    /** Whether `fd` is a pipe which `sink_give` splices into. */
+    bool splice;
+    /** Capacity of the pipe in bytes, if `splice`. */
+    size_t pipe_len;
+    /** Whether to count cycles spent writing. */
+    bool count_cycles;
+    /** Cycles spent writing so far, if `count_cycles`. */
+    uint64_t cycles;
+};
+
+/** Set up sink.
+ *
+ * @param[out] sink sink to initialize.
+ * @param fd file descriptor to write to.
+ * @param splice whether to splice into `fd` if it is a pipe.
+ * @param count_cycles whether to count cycles spent writing.
+ *
+ * **Effects**: writes `*sink`.
+ */
+static void sink_init(struct sink *sink, int fd, bool splice,
+                      bool count_cycles) {
+    *sink = (struct sink){fd, 0, false, 0, count_cycles, 0};
+    struct stat st;
+    if (!splice || fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+        return;
+    int len = fcntl(fd, F_GETPIPE_SZ);
+    if (len > 0) {
+        sink->splice = true;
+        sink->pipe_len = (size_t)len;
+    }
+}
+
+/** Write whole buffer to sink.
+ *
+ * @param sink sink to write to.
+ * @param buf bytes to write.
+ * @param len number of bytes to write.
+ *
+ * @return if writing was successful.
+ *
+ * **Effects**: writes to `sink->fd`, writes `sink->written`, may write
+ * `sink->cycles` and `errno`.
+ */
+static bool sink_write(struct sink *sink, const char *buf, size_t len) {
+    uint64_t start = sink->count_cycles ? now_cycles() : 0;
+    bool ok = write_all(sink->fd, buf, len);
+    if (sink->count_cycles)
+        sink->cycles += now_cycles() - start;
+    if (!ok)
+        return false;
+    sink->written += len;
+    return true;
+}
+
+/** Hand output buffer to sink, which may splice its pages.
+ *
+ * A spliced buffer must not be written again before `sink->pipe_len` more
+ * bytes have entered the pipe, since only then has the reader consumed it.
+ *
+ * @param sink sink to write to.
+ * @param buf page-aligned bytes to write.
+ * @param len number of bytes to write.
+ *
+ * @return if writing was successful.
+ *
+ * **Effects**: writes to `sink->fd`, writes `sink->written`, may write
+ * `sink->cycles` and `errno`.
+ */
+static bool sink_give(struct sink *sink, const char *buf, size_t len) {
+    if (!sink->splice)
+        return sink_write(sink, buf, len);
+    uint64_t start = sink->count_cycles ? now_cycles() : 0;
+    bool ok = splice_all(sink->fd, buf, len);
+    if (sink->count_cycles)
+        sink->cycles += now_cycles() - start;
+    if (!ok)
+        return false;
+    sink->written += len;
+    return true;
+}
+
+/** Two-digit decimal representations of 0 to 99, concatenated. */
+static const char digit_pairs[] = "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+                                  "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+/** Format value as decimal, right-aligned.
+ *
+ * Two digits are produced per division and table lookup.
+ *
+ * @param end pointer past the buffer to write to.
+ * @param v value to format.
+ *
+ * @return pointer to the first written byte.
+ *
+ * @pre
+ * at least `DEC_LEN(uintmax_t)` bytes before `end` are writable.
+ *
+ * **Effects**: writes the bytes from the return value to excluding `end`.
+ */
+static char *fmt_dec_rev(char *end, uintmax_t v) {
+    char *p = end;
+    while (v >= 100) {
+        p -= 2;
+        memcpy(p, digit_pairs + v % 100 * 2, 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + v * 2, 2);
+    } else {
+        *--p = (char)('0' + v);
+    }
+    return p;
+}
+
+/** Format `size_t` as decimal.
+ *
+ * @param dst buffer of at least `DEC_LEN(size_t)` bytes to write to.
+ * @param v value to format.
+ *
+ * @return pointer past the last written byte.
+ *
+ * **Effects**: writes `dst`.
+ */
+static char *fmt_size(char *dst, size_t v) {
+    char tmp[DEC_LEN(uintmax_t)];
+    char *p = fmt_dec_rev(tmp + sizeof(tmp), v);
+    size_t len = (size_t)(tmp + sizeof(tmp) - p);
+    memcpy(dst, p, len);
+    return dst + len;
+}
+
+/** Format `elem` as decimal.
+ *
+ * Wider values than `uintmax_t` are split into chunks of 19 digits.
+ *
+ * @param dst buffer of at least `DEC_LEN(elem)` bytes to write to.
+ * @param v value to format.
+ *
+ * @return pointer past the last written byte.
+ *
+ * **Effects**: writes `dst`.
+ */
+static char *fmt_elem(char *dst, elem v) {
+    char tmp[DEC_LEN(elem) + DEC_LEN(uintmax_t)];
+    char *p = tmp + sizeof(tmp);
+    // Largest power of 10 that fits into a 64-bit uintmax_t
+    const uintmax_t chunk = 10000000000000000000u;
+    while (v > UINTMAX_MAX) {
+        char *end = p;
+        p = fmt_dec_rev(p, (uintmax_t)(v % chunk));
+        v /= chunk;
+        while (end - p < 19)
+            *--p = '0';
+    }
+    p = fmt_dec_rev(p, (uintmax_t)v);
+    size_t len = (size_t)(tmp + sizeof(tmp) - p);
+    memcpy(dst, p, len);
+    return dst + len;
+}
+
+/** Decimal counter for consecutive indices, followed by `] = `. */
+struct dec_counter {
+    /** Digits, right-aligned before `tail`. */
+    char buf[DEC_LEN(size_t)];
+    /** Constant `] = ` after the digits. */
+    char tail[4];
+    /** Pointer to the first digit in `buf`. */
+    char *start;
+};
+
+/** Set decimal counter.
+ *
+ * @param[out] c counter to set.
+ * @param v value to set it to.
+ *
+ * **Effects**: writes `*c`.
+ */
+static void counter_set(struct dec_counter *c, size_t v) {
+    memcpy(c->tail, "] = ", 4);
+    c->start = fmt_dec_rev(c->buf + sizeof(c->buf), v);
+}
+
+/** Increment decimal counter in place.
+ *
+ * @param c counter to increment.
+ *
+ * @pre
+ * the value of `c` is below `SIZE_MAX`.
+ *
+ * **Effects**: writes `*c`.
+ */
+static void counter_inc(struct dec_counter *c) {
+    char *p = c->buf + sizeof(c->buf);
+    while (p > c->start) {
+        if (*--p != '9') {
+            ++*p;
+            return;
+        }
+        *p = '0';
+    }
+    *--c->start = '1';
+}
+
+/** Advance decimal counter to original index of selected index of array.
+ *
+ * @param c counter holding the original index of `a - 1`.
+ * @param arr array whose selected indices to use.
+ * @param d dimension.
+ * @param a selected index into dimension `d`, at least 1.
+ *
+ * **Effects**: writes `*c`.
+ */
+static void counter_next(struct dec_counter *c, const struct arr *arr,
+                         size_t d, size_t a) {
+    if (arr->box[d].step == 1)
+        counter_inc(c);
+    else
+        counter_set(c, box_index(arr, d, a));
+}
+
+/** Build line template of array, if its rows are short enough.
+ *
+ * @param[in,out] arr array whose `k_parts` to write.
+ *
+ * **Effects**: may allocate, may write `arr->k_parts` and `errno`.
+ *
+ * @post
+ * if allocation failed, `arr->k_parts` is still NULL, and lines are
+ * formatted without template.
+ */
+static void build_k_parts(struct arr *arr) {
+    if (arr->k_parts != NULL || arr->z == 0 || arr->z > TEMPLATE_MAX_Z)
+        return;
+    struct k_part *parts = malloc(arr->z * sizeof(struct k_part));
+    if (parts == NULL)
+        return;
+    for (size_t k = 0; k < arr->z; k++) {
+        char *end = fmt_size(parts[k].text, box_index(arr, 2, k));
+        memcpy(end, "] = ", 4);
+        parts[k].len = (unsigned char)(end + 4 - parts[k].text);
+    }
+    arr->k_parts = parts;
+    arr->k_parts_len = arr->z;
+}
+
+/** Format range of elements of array as lines.
+ *
+ * The elements are read with one `arr_block`, so that short rows cost no
+ * lookup each. The `arr[i][` part of the line prefix is only rebuilt when
+ * `i` changes. `j` is kept in a decimal counter, which is incremented in
+ * place unless its dimension has a step. The `k] = ` parts are copied from
+ * the line template `arr->k_parts` if it is built, so that only the values
+ * are formatted per line, and are kept in a decimal counter otherwise. The
+ * lines show the original indices of the selected elements.
+ *
+ * @param arr array to format.
+ * @param e index of the first element to format, in row-major order.
+ * @param n number of elements to format.
+ * @param[out] dst buffer of at least `n * LINE_LEN` bytes.
+ * @param[out] scratch scratch buffer for `arr_block` of at least `n`
+ * elements.
+ *
+ * @return number of bytes written to `dst`.
+ *
+ * @pre
+ * - `e + n <= arr->x * arr->y * arr->z`.
+ * - the elements of `arr` are defined.
+ *
+ * **Effects**: writes `dst`, may write `scratch`.
+ */
+static size_t format_range(const struct arr *arr, size_t e, size_t n,
+                           char *dst, elem *scratch) {
+    if (n == 0)
+        return 0;
+    const elem *v = arr_block(arr, e, n, scratch);
+    size_t y = arr->y, z = arr->z;
+    size_t r = e / z, k = e % z;
+    size_t i = r / y, j = r % y;
+    char prefix[PREFIX_LEN] = {0};
+    memcpy(prefix, "arr[", 4);
+    char *prefix_i = fmt_size(prefix + 4, box_index(arr, 0, i));
+    memcpy(prefix_i, "][", 2);
+    prefix_i += 2;
+    struct dec_counter jc, kc;
+    counter_set(&jc, box_index(arr, 1, j));
+    char *p = dst;
+    while (n > 0) {
+        size_t j_len = (size_t)(jc.buf + sizeof(jc.buf) - jc.start);
+        memcpy(prefix_i, jc.start, j_len);
+        memcpy(prefix_i + j_len, "][", 2);
+        size_t prefix_len = (size_t)(prefix_i - prefix) + j_len + 2;
+        size_t k_end = z - k < n ? z : k + n;
+        n -= k_end - k;
+        const struct k_part *parts = arr->k_parts;
+        for (; parts != NULL && k < k_end; k++) {
+            // Both copies stay within the `LINE_LEN` bytes of the line, and
+            // what they write past their part is overwritten
+            memcpy(p, prefix, PREFIX_LEN);
+            memcpy(p + prefix_len, parts[k].text, sizeof(parts[k].text));
+            p = fmt_elem(p + prefix_len + parts[k].len, *v++);
+            *p++ = '\n';
+        }
+        if (k < k_end)
+            counter_set(&kc, box_index(arr, 2, k));
+        for (; k < k_end; k++) {
+            memcpy(p, prefix, prefix_len);
+            p += prefix_len;
+            size_t kc_len = (size_t)(kc.tail + sizeof(kc.tail) - kc.start);
+            memcpy(p, kc.start, kc_len);
+            p = fmt_elem(p + kc_len, *v++);
+            *p++ = '\n';
+            if (k + 1 < k_end)
+                counter_next(&kc, arr, 2, k + 1);
+        }
+        k = 0;
+        if (n == 0)
+            break;
+        if (++j < y) {
+            counter_next(&jc, arr, 1, j);
+            continue;
+        }
+        j = 0;
+        counter_set(&jc, box_index(arr, 1, 0));
+        prefix_i = fmt_size(prefix + 4, box_index(arr, 0, ++i));
+        memcpy(prefix_i, "][", 2);
+        prefix_i += 2;
+    }
+    return (size_t)(p - dst);
+}
+
+#ifdef HAVE_LZ4
+/** Get LZ4 frame preferences.
+ *
+ * @param level compression level, or 0 for the default.
+ *
+ * @return preferences with the compression level set.
+ */
+static LZ4F_preferences_t lz4_prefs(int level) {
+    LZ4F_preferences_t prefs;
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.compressionLevel = level;
+    return prefs;
+}
+#endif
+
+/** Check if compression is built in.
+ *
+ * @param compression compression to check.
+ *
+ * @return if output can be compressed with `compression`.
+ */
+static bool has_compression(enum arr3d_compression compression) {
+    switch (compression) {
+    case ARR3D_COMPRESSION_NONE:
+        return true;
+    case ARR3D_COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    case ARR3D_COMPRESSION_LZ4:
+#ifdef HAVE_LZ4
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+/** Set up compression buffer and context of output buffer.
+ *
+ * @param[in,out] out output buffer whose `zbuf`, `zbuf_len` and `cctx` to
+ * write.
+ * @param compression compression to set up for.
+ * @param level compression level, or 0 for the default.
+ *
+ * @return if allocation was successful, otherwise `errno` is set.
+ *
+ * @pre
+ * `has_compression(compression)`.
+ *
+ * **Effects**: may allocate, writes `*out`, may write `errno`.
+ *
+ * @post
+ * on failure, nothing is allocated.
+ */
+static bool init_compression(struct out_buf *out,
+                             enum arr3d_compression compression, int level) {
+    (void)level;
+    out->zbuf = NULL;
+    out->zbuf_len = 0;
+    out->cctx = NULL;
+    if (compression == ARR3D_COMPRESSION_NONE)
+        return true;
+#ifdef HAVE_ZSTD
+    if (compression == ARR3D_COMPRESSION_ZSTD) {
+        out->zbuf_len = ZSTD_compressBound(OUT_BUF_SIZE);
+        out->cctx = ZSTD_createCCtx();
+        if (out->cctx == NULL) {
+            errno = ENOMEM;
+            return false;
+        }
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (compression == ARR3D_COMPRESSION_LZ4) {
+        LZ4F_preferences_t prefs = lz4_prefs(level);
+        out->zbuf_len = LZ4F_compressFrameBound(OUT_BUF_SIZE, &prefs);
+    }
+#endif
+    void *map = mmap(NULL, out->zbuf_len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        int err = errno;
+#ifdef HAVE_ZSTD
+        ZSTD_freeCCtx(out->cctx);
+#endif
+        errno = err;
+        return false;
+    }
+    out->zbuf = map;
+    return true;
+}
+
+/** Free compression buffer and context of output buffer.
+ *
+ * @param out output buffer set up by `init_compression`.
+ *
+ * **Frees**: `out->zbuf`, `out->cctx`.
+ */
+static void free_compression(struct out_buf *out) {
+    if (out->zbuf != NULL)
+        munmap(out->zbuf, out->zbuf_len);
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(out->cctx);
+#endif
+}
+
+/** Compress bytes into one independent frame, if requested.
+ *
+ * @param compression compression to use.
+ * @param level compression level, or 0 for the default.
+ * @param out output buffer set up for `compression` whose `zbuf` and `cctx`
+ * to use.
+ * @param src bytes to compress, at most `OUT_BUF_SIZE`.
+ * @param[in,out] len pointer to the number of bytes of `src`, to store the
+ * number of bytes to write.
+ *
+ * @return bytes to write, which are `src` without compression, or NULL if
+ * compression failed, and `errno` is set.
+ *
+ * **Effects**: may write `out->zbuf`, writes `*len`, may write `errno`.
+ */
+static const char *compress_out(enum arr3d_compression compression, int level,
+                                struct out_buf *out, const char *src,
+                                size_t *len) {
+    // Unused without the compression libraries
+    (void)level;
+    (void)out;
+    (void)len;
+    switch (compression) {
+    case ARR3D_COMPRESSION_NONE:
+        return src;
+#ifdef HAVE_ZSTD
+    case ARR3D_COMPRESSION_ZSTD: {
+        size_t r = ZSTD_compressCCtx(out->cctx, out->zbuf, out->zbuf_len, src,
+                                     *len, level);
+        if (ZSTD_isError(r))
+            break;
+        *len = r;
+        return out->zbuf;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case ARR3D_COMPRESSION_LZ4: {
+        LZ4F_preferences_t prefs = lz4_prefs(level);
+        size_t r =
+            LZ4F_compressFrame(out->zbuf, out->zbuf_len, src, *len, &prefs);
+        if (LZ4F_isError(r))
+            break;
+        *len = r;
+        return out->zbuf;
+    }
+#endif
+    default:
+        break;
+    }
+    errno = EIO;
+    return NULL;
+}
+
+/** Format range of elements of array as little-endian `elem`s.
+ *
+ * @param arr array to format.
+ * @param e index of the first element to format, in row-major order.
+ * @param n number of elements to format.
+ * @param[out] dst buffer of at least `n * sizeof(elem)` bytes.
+ * @param[out] scratch scratch buffer for `arr_block` of at least `n`
+ * elements.
+ *
+ * @return number of bytes written to `dst`.
+ *
+ * @pre
+ * - `e + n <= arr->x * arr->y * arr->z`.
+ * - the elements of `arr` are defined.
+ *
+ * **Effects**: writes `dst`, may write `scratch`.
+ */
+static size_t format_raw(const struct arr *arr, size_t e, size_t n, char *dst,
+                         elem *scratch) {
+    copy_le(dst, arr_block(arr, e, n, scratch), n);
+    return n * sizeof(elem);
+}
+
+/** Number of elements formatted into one text chunk. */
+#define CHUNK_ELEMS (OUT_BUF_SIZE / LINE_LEN)
+
+/** Number of ring slots per generator of an output pipeline. */
+#define RING_DEPTH 2
+
+/** Slot of the ring of buffers of an output pipeline. */
+struct ring_slot {
+    /** Output buffers to format one chunk into. */
+    struct out_buf *out;
+    /**
+     * Bytes of the formatted chunk, in `out->buf`, or `out->zbuf` if
+     * compressed, or NULL if compression failed.
+     */
+    const char *data;
+    /** Number of bytes at `data`. */
+    size_t len;
+    /** Whether `data` holds a chunk that has not been written yet. */
+    bool full;
+    /**
+     * Whether `data` has been spliced and may still be referred to by the
+     * pipe, so that `out` must not be filled yet. Only accessed by the I/O
+     * stage, which sets `full` to false once it is cleared.
+     */
+    bool spliced;
+    /** Value of `sink->written` from which on `data` is consumed. */
+    size_t consumed_at;
+    /** Mutex protecting `data`, `len` and `full`. */
+    pthread_mutex_t mutex;
+    /** Condition signalled when `full` changes, or the pipeline stops. */
+    pthread_cond_t cond;
+};
+
+/**
+ * Output pipeline from generators through a ring of buffers to a sink.
+ *
+ * Chunk `c` is formatted into slot `c % nslots` by generator `c % ngens`.
+ * `nslots` is a multiple of `ngens` or at least `nchunks`, so that each
+ * slot is only ever filled by one generator.
+ */
+struct pipeline {
+    /** Array to format. */
+    const struct arr *arr;
+    /** Total number of elements of `arr`. */
+    size_t total;
+    /** Number of elements per chunk. */
+    size_t chunk_elems;
+    /** Lower bound on the length of each chunk but the last in bytes. */
+    size_t min_chunk_len;
+    /** Number of chunks. */
+    size_t nchunks;
+    /** Formatter of a chunk, `format_range` or `format_raw`. */
+    size_t (*format)(const struct arr *arr, size_t e, size_t n, char *dst,
+                     elem *scratch);
+    /** Compression of each chunk. */
+    enum arr3d_compression compression;
+    /** Level of `compression`. */
+    int compression_level;
+    /** Ring of buffers. */
+    struct ring_slot *slots;
+    /** Number of elements of `slots`. */
+    size_t nslots;
+    /** Number of generators. */
+    size_t ngens;
+    /** Flag set by the I/O stage once writing failed. */
+    atomic_bool stop;
+};
+
+/** Generator of an output pipeline. */
+struct generator {
+    /** Pipeline to generate chunks for. */
+    struct pipeline *pipe;
+    /** Index of the first chunk handled. */
+    size_t first;
+    /** Cycles spent formatting, if the array counts cycles. */
+    uint64_t cycles;
+    /** Thread running the generator. */
+    pthread_t thread;
+    /** Whether the generator runs on `thread`. */
+    bool threaded;
+};
+
+/** Format and compress chunk of array into output buffers.
+ *
+ * @param pipe pipeline whose array, formatter and compression to use.
+ * @param c index of the chunk.
+ * @param[out] out output buffers to write.
+ * @param[out] len pointer to store the number of bytes to write.
+ * @param[in,out] cycles counter of the calling thread to add the cycles
+ * spent to, if the array counts cycles.
+ *
+ * @return bytes to write, or NULL if compression failed, and `errno` is set.
+ *
+ * @pre
+ * `c < pipe->nchunks`.
+ *
+ * **Effects**: writes the buffers of `out`, writes `*len`, may write
+ * `*cycles` and `errno`.
+ */
+static const char *format_chunk(const struct pipeline *pipe, size_t c,
+                                struct out_buf *out, size_t *len,
+                                uint64_t *cycles) {
+    uint64_t start = pipe->arr->count_cycles ? now_cycles() : 0;
+    size_t e = c * pipe->chunk_elems;
+    size_t n = pipe->total - e < pipe->chunk_elems ? pipe->total - e
+                                                   : pipe->chunk_elems;
+    *len = pipe->format(pipe->arr, e, n, out->buf, out->scratch);
+    const char *data = compress_out(pipe->compression,
+                                    pipe->compression_level, out, out->buf,
+                                    len);
+    if (pipe->arr->count_cycles)
+        *cycles += now_cycles() - start;
+    return data;
+}
+
+/** Format every `ngens`-th chunk of array, starting at `gen->first`.
+ *
+ * Each chunk is formatted into its slot once the I/O stage has written the
+ * chunk it held before, which bounds how far generators run ahead. With
+ * `ARR3D_NUMA_LOCAL`, the generator moves to the node each chunk was
+ * populated on before formatting it.
+ *
+ * @param arg `struct generator` to run.
+ *
+ * @return NULL.
+ *
+ * **Effects**: writes the slots of the generator, may change the CPU
+ * affinity of the calling thread.
+ */
+static void *generate(void *arg) {
+    struct generator *gen = arg;
+    struct pipeline *pipe = gen->pipe;
+    const struct numa *numa = &pipe->arr->numa;
+    size_t node = SIZE_MAX;
+    for (size_t c = gen->first; c < pipe->nchunks; c += pipe->ngens) {
+        if (numa->policy == ARR3D_NUMA_LOCAL && numa->nnodes > 1) {
+            size_t chunk_node =
+                numa_node_at(numa, c * pipe->chunk_elems, pipe->total);
+            if (chunk_node != node &&
+                pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                       &numa->cpus[chunk_node]) == 0)
+                node = chunk_node;
+        }
+        struct ring_slot *slot = &pipe->slots[c % pipe->nslots];
+        pthread_mutex_lock(&slot->mutex);
+        while (slot->full && !atomic_load(&pipe->stop))
+            pthread_cond_wait(&slot->cond, &slot->mutex);
+        pthread_mutex_unlock(&slot->mutex);
+        if (atomic_load(&pipe->stop))
+            break;
+        size_t len;
+        const char *data = format_chunk(pipe, c, slot->out, &len,
+                                        &gen->cycles);
+        pthread_mutex_lock(&slot->mutex);
+        slot->data = data;
+        slot->len = len;
+        slot->full = true;
+        pthread_cond_signal(&slot->cond);
+        pthread_mutex_unlock(&slot->mutex);
+    }
+    return NULL;
+}
+
+/** Ensure that array handle keeps enough output buffers.
+ *
+ * @param a array handle whose `bufs` to extend.
+ * @param n number of buffers needed.
+ *
+ * @return `ARR3D_OK`, or `ARR3D_BUFFER` if allocation failed.
+ *
+ * @pre
+ * `a->filled`.
+ *
+ * **Effects**: may allocate, may write `a->bufs`, `a->nbufs` and `errno`.
+ *
+ * @post
+ * on success, `a->nbufs >= n`.
+ */
+static enum arr3d_status get_out_bufs(struct arr3d *a, size_t n) {
+    if (n <= a->nbufs)
+        return ARR3D_OK;
+    struct out_buf *bufs = realloc(a->bufs, n * sizeof(struct out_buf));
+    if (bufs == NULL)
+        return ARR3D_BUFFER;
+    a->bufs = bufs;
+    for (; a->nbufs < n; a->nbufs++) {
+        struct out_buf *b = &bufs[a->nbufs];
+        void *map = mmap(NULL, OUT_BUF_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            return ARR3D_BUFFER;
+        b->buf = map;
+        if (!alloc_scratch(&a->arr, SCRATCH_ELEMS, &b->scratch)) {
+            int err = errno;
+            munmap(b->buf, OUT_BUF_SIZE);
+            errno = err;
+            return ARR3D_BUFFER;
+        }
+        if (!init_compression(b, a->opts.compression,
+                              a->opts.compression_level)) {
+            int err = errno;
+            free(b->scratch);
+            munmap(b->buf, OUT_BUF_SIZE);
+            errno = err;
+            return ARR3D_BUFFER;
+        }
+    }
+    return ARR3D_OK;
+}
+
+/** Free output buffers of array handle.
+ *
+ * Spliced buffers are unmapped, so their pages stay intact for the pipe.
+ *
+ * @param a array handle whose `bufs` to free.
+ *
+ * **Frees**: the output buffers of `a`.
+ *
+ * @post
+ * `a->nbufs == 0`.
+ */
+static void free_out_bufs(struct arr3d *a) {
+    for (size_t b = 0; b < a->nbufs; b++) {
+        munmap(a->bufs[b].buf, OUT_BUF_SIZE);
+        free(a->bufs[b].scratch);
+        free_compression(&a->bufs[b]);
+    }
+    free(a->bufs);
+    a->bufs = NULL;
+    a->nbufs = 0;
+}
+
+/** Give formatted chunk to sink.
+ *
+ * @param sink sink to write to.
+ * @param data bytes of the chunk, or NULL if compressing it failed.
+ * @param len number of bytes at `data`.
+ *
+ * @return `ARR3D_OK`, `ARR3D_COMPRESS` or `ARR3D_OUTPUT`.
+ *
+ * **Effects**: writes to `sink`, may write `errno`.
+ */
+static enum arr3d_status give_chunk(struct sink *sink, const char *data,
+                                    size_t len) {
+    if (data == NULL) {
+        // Set here, since the chunk may have been compressed by another thread
+        errno = EIO;
+        return ARR3D_COMPRESS;
+    }
+    return sink_give(sink, data, len) ? ARR3D_OK : ARR3D_OUTPUT;
+}
+
+/** Let generators fill spliced slots again whose pages have been consumed.
+ *
+ * @param pipe pipeline whose slots to release.
+ * @param sink sink the slots were spliced into.
+ *
+ * **Effects**: writes `pipe->slots`.
+ */
+static void release_slots(struct pipeline *pipe, const struct sink *sink) {
+    for (size_t s = 0; s < pipe->nslots; s++) {
+        struct ring_slot *slot = &pipe->slots[s];
+        if (!slot->spliced || sink->written < slot->consumed_at)
+            continue;
+        slot->spliced = false;
+        pthread_mutex_lock(&slot->mutex);
+        slot->full = false;
+        pthread_cond_signal(&slot->cond);
+        pthread_mutex_unlock(&slot->mutex);
+    }
+}
+
+/** Format array through a pipeline and write chunks in order.
+ *
+ * Generator threads format chunks into a ring of `RING_DEPTH` buffers per
+ * generator, and the calling thread is the I/O stage, which writes them to
+ * `sink` in index order, so that formatting overlaps with writing, and the
+ * output is the same as that of a serial formatter. Memory use is bounded by
+ * the ring, since a generator waits for its next slot to be written. Chunks
+ * of generators for which no thread could be created are formatted by the
+ * calling thread.
+ *
+ * If `sink` splices, a slot is only filled again once `sink->pipe_len` more
+ * bytes have entered the pipe after it. That happens by the time the slot is
+ * needed, since the I/O stage splices the chunks of the other slots first,
+ * so splicing is only kept if those are long enough.
+ *
+ * @param pipe pipeline with `arr`, `total`, `chunk_elems`, `nchunks` and
+ * `format` defined, and the rest to initialize.
+ * @param a array handle to print, whose options select the desired number
+ * of generators.
+ * @param sink sink to write to.
+ *
+ * @return `ARR3D_OK`, `ARR3D_BUFFER`, `ARR3D_JOBS`, `ARR3D_COMPRESS` or
+ * `ARR3D_OUTPUT`.
+ *
+ * @pre
+ * - `pipe->nchunks > 1`.
+ * - `a->filled`.
+ *
+ * **Effects**: may allocate, may create threads, writes `*pipe`, writes to
+ * `sink`, may write the format counters of `a->stats` and `errno`.
+ */
+static enum arr3d_status print_pipelined(struct pipeline *pipe,
+                                         struct arr3d *a, struct sink *sink) {
+    size_t nchunks = pipe->nchunks;
+    pipe->ngens = a->opts.jobs < nchunks ? a->opts.jobs : nchunks;
+    pipe->nslots = pipe->ngens * RING_DEPTH < nchunks
+                       ? pipe->ngens * RING_DEPTH
+                       : nchunks;
+    if (sink->splice && pipe->nslots < nchunks &&
+        sink->pipe_len > pipe->min_chunk_len * (pipe->nslots - 1))
+        sink->splice = false;
+    enum arr3d_status status = get_out_bufs(a, pipe->nslots);
+    if (status != ARR3D_OK)
+        return status;
+    pipe->slots = calloc(pipe->nslots, sizeof(struct ring_slot));
+    struct generator *gens =
+        pipe->slots == NULL ? NULL : calloc(pipe->ngens, sizeof(*gens));
+    if (gens == NULL) {
+        int err = errno;
+        free(pipe->slots);
+        errno = err;
+        return ARR3D_JOBS;
+    }
+    atomic_init(&pipe->stop, false);
+    for (size_t s = 0; s < pipe->nslots; s++) {
+        struct ring_slot *slot = &pipe->slots[s];
+        slot->out = &a->bufs[s];
+        pthread_mutex_init(&slot->mutex, NULL);
+        pthread_cond_init(&slot->cond, NULL);
+    }
+    for (size_t g = 0; g < pipe->ngens; g++) {
+        gens[g].pipe = pipe;
+        gens[g].first = g;
+        gens[g].threaded =
+            pthread_create(&gens[g].thread, NULL, generate, &gens[g]) == 0;
+    }
+    status = ARR3D_OK;
+    uint64_t own_cycles = 0;
+    for (size_t c = 0; c < nchunks && status == ARR3D_OK; c++) {
+        struct ring_slot *slot = &pipe->slots[c % pipe->nslots];
+        if (!gens[c % pipe->ngens].threaded) {
+            slot->data =
+                format_chunk(pipe, c, slot->out, &slot->len, &own_cycles);
+            status = give_chunk(sink, slot->data, slot->len);
+            if (sink->splice) {
+                slot->spliced = true;
+                slot->consumed_at = sink->written + sink->pipe_len;
+                release_slots(pipe, sink);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&slot->mutex);
+        while (!slot->full)
+            pthread_cond_wait(&slot->cond, &slot->mutex);
+        pthread_mutex_unlock(&slot->mutex);
+        status = give_chunk(sink, slot->data, slot->len);
+        if (sink->splice) {
+            slot->spliced = true;
+            slot->consumed_at = sink->written + sink->pipe_len;
+            release_slots(pipe, sink);
+            continue;
+        }
+        pthread_mutex_lock(&slot->mutex);
+        slot->full = false;
+        pthread_cond_signal(&slot->cond);
+        pthread_mutex_unlock(&slot->mutex);
+    }
+    int err = errno;
+    if (status != ARR3D_OK) {
+        atomic_store(&pipe->stop, true);
+        for (size_t s = 0; s < pipe->nslots; s++) {
+            pthread_mutex_lock(&pipe->slots[s].mutex);
+            pthread_cond_signal(&pipe->slots[s].cond);
+            pthread_mutex_unlock(&pipe->slots[s].mutex);
+        }
+    }
+    for (size_t g = 0; g < pipe->ngens; g++)
+        if (gens[g].threaded) {
+            pthread_join(gens[g].thread, NULL);
+            count_format(&a->stats, gens[g].cycles);
+        }
+    count_format(&a->stats, own_cycles);
+    for (size_t s = 0; s < pipe->nslots; s++) {
+        pthread_cond_destroy(&pipe->slots[s].cond);
+        pthread_mutex_destroy(&pipe->slots[s].mutex);
+    }
+    free(gens);
+    free(pipe->slots);
+    errno = err;
+    return status;
+}
+
+/** Format elements of array in chunks and write them.
+ *
+ * Arrays of more than one chunk go through `print_pipelined`, and the rest
+ * are formatted and written by the calling thread. With compression, each
+ * chunk is compressed into an independent frame by the thread that formats
+ * it, so that frames are produced in parallel.
+ * After splicing, the output buffers of `a` are freed, since the pipe may
+ * still refer to them.
+ *
+ * @param a array handle to print, whose options select the desired number
+ * of generator threads.
+ * @param chunk_elems number of elements per chunk, whose formatted length
+ * is at most `OUT_BUF_SIZE` bytes.
+ * @param elem_len lower bound on the formatted length of an element.
+ * @param format formatter of a chunk, `format_range` or `format_raw`.
+ * @param sink sink to write to.
+ *
+ * @return `ARR3D_OK`, `ARR3D_BUFFER`, `ARR3D_JOBS`, `ARR3D_COMPRESS` or
+ * `ARR3D_OUTPUT`.
+ *
+ * @pre
+ * - `0 < chunk_elems <= SCRATCH_ELEMS`.
+ * - `a->filled`.
+ *
+ * **Effects**: may allocate, writes to `sink`, may create threads, may write
+ * the format counters of `a->stats` and `errno`.
+ */
+static enum arr3d_status
+print_chunks(struct arr3d *a, size_t chunk_elems, size_t elem_len,
+             size_t (*format)(const struct arr *arr, size_t e, size_t n,
+                              char *dst, elem *scratch),
+             struct sink *sink) {
+    const struct arr *arr = &a->arr;
+    size_t total = arr->x * arr->y * arr->z;
+    struct pipeline pipe = {
+        .arr = arr,
+        .total = total,
+        .chunk_elems = chunk_elems,
+        .min_chunk_len = chunk_elems * elem_len,
+        .nchunks = total / chunk_elems + (total % chunk_elems != 0),
+        .format = format,
+        .compression = a->opts.compression,
+        .compression_level = a->opts.compression_level,
+    };
+    // Compressed chunks may be arbitrarily short
+    if (pipe.compression != ARR3D_COMPRESSION_NONE)
+        pipe.min_chunk_len = 0;
+    // Compressed output is at least one frame, even if empty
+    if (pipe.nchunks == 0 && pipe.compression == ARR3D_COMPRESSION_NONE)
+        return ARR3D_OK;
+    enum arr3d_status status;
+    if (pipe.nchunks > 1) {
+        status = print_pipelined(&pipe, a, sink);
+    } else {
+        status = get_out_bufs(a, 1);
+        if (status != ARR3D_OK)
+            return status;
+        struct out_buf *out = &a->bufs[0];
+        size_t len = 0;
+        uint64_t cycles = 0;
+        const char *data =
+            pipe.nchunks == 0
+                ? compress_out(pipe.compression, pipe.compression_level, out,
+                               out->buf, &len)
+                : format_chunk(&pipe, 0, out, &len, &cycles);
+        count_format(&a->stats, cycles);
+        status = give_chunk(sink, data, len);
+    }
+    if (sink->splice) {
+        int err = errno;
+        free_out_bufs(a);
+        errno = err;
+    }
+    return status;
+}
+
+/** Print elements of array as text.
+ *
+ * Lines are formatted in chunks of `CHUNK_ELEMS` elements into buffers of
+ * `OUT_BUF_SIZE` bytes, which are written to `sink` as a whole. The line
+ * template of the array is built on first use and kept for later calls.
+ *
+ * @param a array handle to print, whose options select the desired number
+ * of formatting threads.
+ * @param sink sink to write to.
+ *
+ * @return `ARR3D_OK`, `ARR3D_BUFFER`, `ARR3D_JOBS`, `ARR3D_COMPRESS` or
+ * `ARR3D_OUTPUT`.
+ *
+ * @pre
+ * `a->filled`.
+ *
+ * **Effects**: may allocate, writes to `sink`, may create threads, may write
+ * `errno`.
+ */
+static enum arr3d_status print_arr_text(struct arr3d *a, struct sink *sink) {
+    build_k_parts(&a->arr);
+    return print_chunks(a, CHUNK_ELEMS, sizeof("arr[0][0][0] = 0\n") - 1,
+                        format_range, sink);
+}
+
+/** Print elements of array in binary.
+ *
+ * A contiguous array on a little-endian host is written with a single write
+ * of its backing block, unless it is compressed. Otherwise elements are
+ * converted in chunks of `SCRATCH_ELEMS` into buffers of `OUT_BUF_SIZE`
+ * bytes, which are written to `sink` as a whole. A compressed `.npy` header
+ * is a frame of its own.
+ *
+ * @param a array handle to print, whose options select the desired number
+ * of generator threads.
+ * @param npy whether to precede the elements with a `.npy` header.
+ * @param sink sink to write to.
+ *
+ * @return `ARR3D_OK`, `ARR3D_NPY`, `ARR3D_BUFFER`, `ARR3D_JOBS`,
+ * `ARR3D_COMPRESS` or `ARR3D_OUTPUT`.
+ *
+ * @pre
+ * `a->filled`.
+ *
+ * **Effects**: may allocate, writes to `sink`, may create threads, may write
+ * `errno`.
+ */
+static enum arr3d_status print_arr_binary(struct arr3d *a, bool npy,
+                                          struct sink *sink) {
+    const struct arr *arr = &a->arr;
+    enum arr3d_compression compression = a->opts.compression;
+    if (npy) {
+        char header[NPY_HEADER_LEN];
+        size_t len = format_npy_header(arr, header);
+        if (len == 0)
+            return ARR3D_NPY;
+        const char *data = header;
+        if (compression != ARR3D_COMPRESSION_NONE) {
+            enum arr3d_status status = get_out_bufs(a, 1);
+            if (status != ARR3D_OK)
+                return status;
+            struct out_buf *out = &a->bufs[0];
+            memcpy(out->buf, header, len);
+            data = compress_out(compression, a->opts.compression_level, out,
+                                out->buf, &len);
+            if (data == NULL)
+                return ARR3D_COMPRESS;
+        }
+        if (!sink_write(sink, data, len))
+            return ARR3D_OUTPUT;
+    }
+    if (arr->layout == ARR3D_LAYOUT_FLAT && is_little_endian() &&
+        compression == ARR3D_COMPRESSION_NONE)
+        return sink_write(sink, (const char *)arr->flat,
+                          arr->x * arr->y * arr->z * sizeof(elem))
+                   ? ARR3D_OK
+                   : ARR3D_OUTPUT;
+    return print_chunks(a, SCRATCH_ELEMS, sizeof(elem), format_raw, sink);
+}
+
+const char *arr3d_strstatus(enum arr3d_status status) {
+    switch (status) {
+    case ARR3D_OK:
+        return "success";
+    case ARR3D_ALLOC:
+        return "array allocation";
+    case ARR3D_JOBS:
+        return "job allocation";
+    case ARR3D_BUFFER:
+        return "output buffer allocation";
+    case ARR3D_OUTPUT_FILE:
+        return "output file";
+    case ARR3D_OUTPUT:
+        return "value output";
+    case ARR3D_OVERFLOW:
+        return "value overflow";
+    case ARR3D_NPY:
+        return "unsupported npy element size";
+    case ARR3D_RANGE:
+        return "index out of range";
+    case ARR3D_UNFILLED:
+        return "array not filled";
+    case ARR3D_INVALID:
+        return "invalid options";
+    case ARR3D_SIZE:
+        return "array size";
+    case ARR3D_MEMORY:
+        return "memory limit";
+    case ARR3D_COMPRESS:
+        return "compression";
+    }
+    return "unknown status";
+}
+
+enum arr3d_status arr3d_create(struct arr3d **arr, size_t x, size_t y,
+                               size_t z, const struct arr3d_opts *opts) {
+    const struct arr3d_range box[3] = {{0, x, 1}, {0, y, 1}, {0, z, 1}};
+    return arr3d_create_box(arr, box, opts);
+}
+
+enum arr3d_status arr3d_create_box(struct arr3d **arr,
+                                   const struct arr3d_range box[3],
+                                   const struct arr3d_opts *opts) {
+    size_t i, j, k;
+    if (opts->jobs == 0 || box[0].step == 0 || box[1].step == 0 ||
+        box[2].step == 0 ||
+        (opts->map_fd >= 0 && (opts->map_format == ARR3D_FORMAT_TEXT ||
+                               opts->compression != ARR3D_COMPRESSION_NONE)))
+        return ARR3D_INVALID;
+    if (!has_compression(opts->compression)) {
+        errno = ENOTSUP;
+        return ARR3D_COMPRESS;
+    }
+    if (!opts->wrap && arr3d_find_overflow(box, &i, &j, &k))
+        return ARR3D_OVERFLOW;
+    struct arr3d *a = malloc(sizeof(struct arr3d));
+    if (a == NULL)
+        return ARR3D_ALLOC;
+    a->arr.x = range_len(&box[0]);
+    a->arr.y = range_len(&box[1]);
+    a->arr.z = range_len(&box[2]);
+    memcpy(a->arr.box, box, sizeof(a->arr.box));
+    a->arr.k_parts = NULL;
+    a->arr.k_parts_len = 0;
+    load_numa(&a->arr.numa, opts->numa);
+    a->opts = *opts;
+    a->filled = false;
+    a->bufs = NULL;
+    a->nbufs = 0;
+    a->stats = (struct arr3d_stats){0};
+    *arr = a;
+    return ARR3D_OK;
+}
+
+enum arr3d_status arr3d_set_box(struct arr3d *arr,
+                                const struct arr3d_range box[3]) {
+    size_t i, j, k;
+    if (box[0].step == 0 || box[1].step == 0 || box[2].step == 0)
+        return ARR3D_INVALID;
+    if (!arr->opts.wrap && arr3d_find_overflow(box, &i, &j, &k))
+        return ARR3D_OVERFLOW;
+    if (arr->filled) {
+        free_arr(&arr->arr);
+        arr->filled = false;
+    }
+    size_t z = range_len(&box[2]);
+    // The template depends on the indices of the third dimension only
+    if (box[2].start != arr->arr.box[2].start ||
+        box[2].step != arr->arr.box[2].step || z > arr->arr.k_parts_len) {
+        free(arr->arr.k_parts);
+        arr->arr.k_parts = NULL;
+    }
+    arr->arr.x = range_len(&box[0]);
+    arr->arr.y = range_len(&box[1]);
+    arr->arr.z = z;
+    memcpy(arr->arr.box, box, sizeof(arr->arr.box));
+    return ARR3D_OK;
+}
+
+enum arr3d_status arr3d_fill(struct arr3d *arr, size_t *allocs) {
+    if (arr->filled) {
+        free_arr(&arr->arr);
+        arr->filled = false;
+    }
+    arr->stats = (struct arr3d_stats){0};
+    *allocs = 0;
+    size_t bytes;
+    enum arr3d_status status = arr3d_plan(arr, NULL, &bytes);
+    if (status != ARR3D_OK)
+        return status;
+    if (arr->opts.mem_limit > 0 && bytes > arr->opts.mem_limit) {
+        errno = ENOMEM;
+        return ARR3D_MEMORY;
+    }
+    PROBE3(fill__start, arr->arr.x, arr->arr.y, arr->arr.z);
+    uint64_t start = arr->opts.count_cycles ? now_cycles() : 0;
+    status = mk_arr(&arr->arr, &arr->opts, &arr->stats);
+    // Layouts populated without jobs are populated by the calling thread
+    if (arr->opts.count_cycles && arr->stats.fill_threads == 0) {
+        arr->stats.fill_cycles = arr->stats.fill_max_cycles =
+            now_cycles() - start;
+        arr->stats.fill_threads = 1;
+    }
+    PROBE2(fill__done, status, arr->stats.allocs);
+    *allocs = arr->stats.allocs;
+    arr->filled = status == ARR3D_OK;
+    return status;
+}
+
+enum arr3d_status arr3d_plan(const struct arr3d *arr, struct arr3d_stats *plan,
+                             size_t *bytes) {
+    struct arr3d_stats tmp;
+    if (!plan_arr(&arr->arr, &arr->opts, plan != NULL ? plan : &tmp, bytes)) {
+        errno = EOVERFLOW;
+        return ARR3D_SIZE;
+    }
+    return ARR3D_OK;
+}
+
+void arr3d_get_stats(const struct arr3d *arr, struct arr3d_stats *stats) {
+    *stats = arr->stats;
+}
+
+enum arr3d_status arr3d_get(const struct arr3d *arr, size_t i, size_t j,
+                            size_t k, elem *v) {
+    if (!arr->filled)
+        return ARR3D_UNFILLED;
+    if (i >= arr->arr.x || j >= arr->arr.y || k >= arr->arr.z)
+        return ARR3D_RANGE;
+    elem scratch;
+    *v = *arr_row_part(&arr->arr, i, j, k, 1, &scratch);
+    return ARR3D_OK;
+}
+
+enum arr3d_status arr3d_get_row(const struct arr3d *arr, size_t i, size_t j,
+                                size_t k, size_t n, elem *dst) {
+    if (!arr->filled)
+        return ARR3D_UNFILLED;
+    if (i >= arr->arr.x || j >= arr->arr.y || k > arr->arr.z ||
+        n > arr->arr.z - k)
+        return ARR3D_RANGE;
+    if (n == 0)
+        return ARR3D_OK;
+    const elem *row = arr_row_part(&arr->arr, i, j, k, n, dst);
+    if (row != dst)
+        memcpy(dst, row, n * sizeof(elem));
+    return ARR3D_OK;
+}
+
+enum arr3d_status arr3d_format(struct arr3d *arr, enum arr3d_format format,
+                               int fd, size_t *written) {
+    if (!arr->filled)
+        return ARR3D_UNFILLED;
+    if (arr->opts.map_fd >= 0 && fd == arr->opts.map_fd &&
+        format == arr->opts.map_format) {
+        // Already built in place by `mk_arr`
+        *written = arr->arr.map != NULL ? arr->arr.map_len : 0;
+        return ARR3D_OK;
+    }
+    arr->stats.format_cycles = 0;
+    arr->stats.format_max_cycles = 0;
+    arr->stats.format_threads = 0;
+    PROBE2(format__start, format, fd);
+    struct sink sink;
+    sink_init(&sink, fd, arr->opts.splice, arr->opts.count_cycles);
+    enum arr3d_status status =
+        format == ARR3D_FORMAT_TEXT
+            ? print_arr_text(arr, &sink)
+            : print_arr_binary(arr, format == ARR3D_FORMAT_NPY, &sink);
+    arr->stats.write_cycles = sink.cycles;
+    PROBE2(format__done, status, sink.written);
+    if (status == ARR3D_OK)
+        *written = sink.written;
+    return status;
+}
+
+void arr3d_destroy(struct arr3d *arr) {
+    if (arr == NULL)
+        return;
+    if (arr->filled)
+        free_arr(&arr->arr);
+    free_out_bufs(arr);
+    free(arr->arr.k_parts);
+    free(arr->arr.numa.cpus);
+    free(arr);
+}
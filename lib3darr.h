@@ -0,0 +1,458 @@
+#ifndef LIB3DARR_H
+#define LIB3DARR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file lib3darr.h
+ * Interface of the `lib3darr` library.
+ * Builds 3D arrays whose element `arr[i][j][k]` is `2^i * 3^j * 5^k`, or
+ * boxes of selected indices of them, and formats them, behind an opaque
+ * handle which can be kept and reused.
+ * Functions report failure by returning an `enum arr3d_status` instead of
+ * printing or exiting, and never touch stdio streams.
+ * The implicit preconditions stated in `lib3darr.c` apply here as well.
+ */
+
+#ifdef ELEM_U128
+/**
+ * Element of our array.
+ * Selected with `ELEM=u128` in the Makefile, so that more values stay unique.
+ */
+__extension__ typedef unsigned __int128 elem;
+#else
+/**
+ * Element of our array.
+ * The fact that this is an unsigned integer type is relied on.
+ */
+typedef unsigned long elem;
+#endif
+
+/** Maximum value of an `elem`. */
+#define ELEM_MAX ((elem)-1)
+
+/** Storage layout of an array. */
+enum arr3d_layout {
+    /** Tree of `1 + x + x*y` separately allocated tables and rows. */
+    ARR3D_LAYOUT_TREE,
+    /** One contiguous block of `x*y*z` elements in row-major order. */
+    ARR3D_LAYOUT_FLAT,
+    /** No storage; elements are generated as they are read. */
+    ARR3D_LAYOUT_STREAM,
+    /**
+     * Tables of the `x + y + z` powers of 2, 3 and 5; each element is
+     * computed from them when it is read.
+     */
+    ARR3D_LAYOUT_LAZY,
+};
+
+/** Output format. */
+enum arr3d_format {
+    /** Lines of the form `arr[i][j][k] = v`. */
+    ARR3D_FORMAT_TEXT,
+    /** Elements in row-major order as little-endian `elem`s. */
+    ARR3D_FORMAT_RAW,
+    /** `ARR3D_FORMAT_RAW` preceded by a NumPy `.npy` header. */
+    ARR3D_FORMAT_NPY,
+};
+
+/** Compression of output. */
+enum arr3d_compression {
+    /** Output is written as is. */
+    ARR3D_COMPRESSION_NONE,
+    /** Independent Zstandard frames, if built with `HAVE_ZSTD`. */
+    ARR3D_COMPRESSION_ZSTD,
+    /** Independent LZ4 frames, if built with `HAVE_LZ4`. */
+    ARR3D_COMPRESSION_LZ4,
+};
+
+/** Placement of the array and its workers on NUMA nodes. */
+enum arr3d_numa_policy {
+    /** Threads and pages are placed by the kernel. */
+    ARR3D_NUMA_NONE,
+    /** Pages of the array are interleaved across the nodes with memory. */
+    ARR3D_NUMA_INTERLEAVE,
+    /**
+     * Workers populating each part of the array are pinned to the CPUs of
+     * one node, spreading the parts across the nodes, and workers formatting
+     * a part are pinned to the node it was populated on.
+     */
+    ARR3D_NUMA_LOCAL,
+};
+
+/** Allocation policy of the backing block of a contiguous array. */
+enum arr3d_backing {
+    /** Plain `malloc`. */
+    ARR3D_BACKING_MALLOC,
+    /** `posix_memalign` aligned to the page size. */
+    ARR3D_BACKING_ALIGNED,
+    /** Anonymous mapping aligned to and backed by huge pages if possible. */
+    ARR3D_BACKING_HUGE,
+};
+
+/** Allocation policy of the storage of a pointer tree. */
+enum arr3d_tree_alloc {
+    /** Every table and row is allocated with `malloc`. */
+    ARR3D_TREE_ALLOC_MALLOC,
+    /** Tables and rows are carved out of one block, freed at once. */
+    ARR3D_TREE_ALLOC_ARENA,
+};
+
+/** Result of a library function. */
+enum arr3d_status {
+    /** Success. */
+    ARR3D_OK,
+    /** Allocating the array failed; `errno` is set. */
+    ARR3D_ALLOC,
+    /** Allocating the jobs populating or formatting failed; `errno` is set. */
+    ARR3D_JOBS,
+    /** Allocating an output buffer failed; `errno` is set. */
+    ARR3D_BUFFER,
+    /** Resizing or mapping the output file failed; `errno` is set. */
+    ARR3D_OUTPUT_FILE,
+    /** Writing output failed; `errno` is set. */
+    ARR3D_OUTPUT,
+    /** Some value does not fit into an `elem`, and wrapping is not allowed. */
+    ARR3D_OVERFLOW,
+    /** The `.npy` format has no unsigned integer type of the size of `elem`. */
+    ARR3D_NPY,
+    /** An index is out of range. */
+    ARR3D_RANGE,
+    /** The array has not been filled. */
+    ARR3D_UNFILLED,
+    /** The options are inconsistent. */
+    ARR3D_INVALID,
+    /** The size of the array does not fit into a `size_t`; `errno` is set. */
+    ARR3D_SIZE,
+    /** The storage of the array exceeds `mem_limit`; `errno` is set. */
+    ARR3D_MEMORY,
+    /**
+     * Compressing output failed, or the compression is not built in;
+     * `errno` is set.
+     */
+    ARR3D_COMPRESS,
+};
+
+/** Options of an array. */
+struct arr3d_opts {
+    /** Storage layout of the array. */
+    enum arr3d_layout layout;
+    /** Whether to build a row pointer view in `ARR3D_LAYOUT_FLAT`. */
+    bool views;
+    /**
+     * Allocation policy of the backing block in `ARR3D_LAYOUT_FLAT`, or of the
+     * arena in `ARR3D_LAYOUT_TREE`.
+     */
+    enum arr3d_backing backing;
+    /** Allocation policy of the storage in `ARR3D_LAYOUT_TREE`. */
+    enum arr3d_tree_alloc tree_alloc;
+    /** Number of parallel jobs to populate and format the array with. */
+    size_t jobs;
+    /** Whether to allow values to wrap around instead of failing. */
+    bool wrap;
+    /**
+     * File descriptor open for reading and writing to build binary output of
+     * the array in, or -1. If set, the array is stored contiguously in a
+     * mapping of the file, whatever `layout` says. On big-endian hosts, the
+     * elements are then stored little-endian, and only the file holds their
+     * values.
+     */
+    int map_fd;
+    /**
+     * Format of the output built in `map_fd`, `ARR3D_FORMAT_RAW` or
+     * `ARR3D_FORMAT_NPY`.
+     */
+    enum arr3d_format map_format;
+    /**
+     * Whether to time allocator calls for `arr3d_get_stats`, at the cost of
+     * reading a clock around each of them. Everything else is counted
+     * regardless.
+     */
+    bool time_allocs;
+    /**
+     * Whether to count cycles of the populating, formatting and writing
+     * threads for `arr3d_get_stats`, at the cost of reading the cycle counter
+     * around each job, chunk and write.
+     */
+    bool count_cycles;
+    /**
+     * Maximum number of bytes of storage to allocate, as computed by
+     * `arr3d_plan`, or 0 for no limit.
+     */
+    size_t mem_limit;
+    /**
+     * Whether `arr3d_format` may splice its output buffers into a pipe with
+     * `vmsplice` instead of copying them. Readers that splice the pipe onward
+     * instead of reading it could then observe buffers being reused, so this
+     * is only safe if the reader reads.
+     */
+    bool splice;
+    /**
+     * Compression of the output of `arr3d_format`. Each chunk of output is
+     * compressed into its own frame by the thread that formatted it, so
+     * that the frames concatenate to a valid stream. Not allowed together
+     * with `map_fd`.
+     */
+    enum arr3d_compression compression;
+    /** Level of `compression`, or 0 for the default of the library. */
+    int compression_level;
+    /**
+     * NUMA placement of the storage and the worker threads. Only advice, so
+     * it has no effect where the topology is unknown or cannot be applied.
+     */
+    enum arr3d_numa_policy numa;
+};
+
+/** Allocation statistics of the last population of an array. */
+struct arr3d_stats {
+    /** Number of successful allocations. */
+    size_t allocs;
+    /** Number of failed allocations. */
+    size_t failed_allocs;
+    /** Bytes requested for tables of pointers. */
+    size_t table_bytes;
+    /** Bytes requested for elements, including power tables. */
+    size_t elem_bytes;
+    /** Bytes of the block an arena carves tables and rows out of, or 0. */
+    size_t arena_bytes;
+    /** Nanoseconds spent in allocator calls, if `time_allocs`, or 0. */
+    uint64_t alloc_ns;
+    /** Nanoseconds spent freeing everything after a failure, or 0. */
+    uint64_t unwind_ns;
+    /**
+     * Cycles spent populating, summed over the threads, if `count_cycles`,
+     * or 0. Cycles are those of the time stamp counter on x86-64, and
+     * nanoseconds elsewhere.
+     */
+    uint64_t fill_cycles;
+    /** Most cycles spent populating by one thread. */
+    uint64_t fill_max_cycles;
+    /** Number of threads that populated. */
+    size_t fill_threads;
+    /**
+     * Cycles spent formatting and compressing by the last `arr3d_format`,
+     * summed over the threads, if `count_cycles`, or 0.
+     */
+    uint64_t format_cycles;
+    /** Most cycles spent formatting by one thread. */
+    uint64_t format_max_cycles;
+    /** Number of threads that formatted. */
+    size_t format_threads;
+    /** Cycles spent writing by the last `arr3d_format`. */
+    uint64_t write_cycles;
+};
+
+/**
+ * Selected indices `start`, `start + step`, ... below `stop` of a dimension.
+ * The selection is empty if `start >= stop`.
+ */
+struct arr3d_range {
+    /** First index. */
+    size_t start;
+    /** Bound on the indices. */
+    size_t stop;
+    /** Distance between indices, at least 1. */
+    size_t step;
+};
+
+/** Opaque handle of an array, its storage and its output buffers. */
+struct arr3d;
+
+/** Get description of status.
+ *
+ * @param status status to describe.
+ *
+ * @return static nul-terminated description, suitable as a `perror` prefix.
+ */
+const char *arr3d_strstatus(enum arr3d_status status);
+
+/** Find first selected element whose value does not fit into an `elem`.
+ *
+ * @param box selected indices of each dimension.
+ * @param[out] i pointer to store the index into the first layer.
+ * @param[out] j pointer to store the index into the second layer.
+ * @param[out] k pointer to store the index into the third layer.
+ *
+ * @return if any selected element overflows.
+ *
+ * @pre
+ * `box[d].step > 0` for all `d < 3`.
+ *
+ * **Effects**: writes `*i`, `*j`, `*k` if any selected element overflows.
+ */
+bool arr3d_find_overflow(const struct arr3d_range box[3], size_t *i,
+                         size_t *j, size_t *k);
+
+/** Create unfilled array.
+ *
+ * @param[out] arr pointer to store the handle.
+ * @param x size of the first layer.
+ * @param y size of each second layer.
+ * @param z size of each third layer.
+ * @param opts options of the array, copied into the handle.
+ *
+ * @return `ARR3D_OK`, `ARR3D_ALLOC`, `ARR3D_OVERFLOW` unless `opts->wrap`,
+ * `ARR3D_COMPRESS` if the compression is not built in, or `ARR3D_INVALID`.
+ *
+ * **Effects**: allocates, writes `*arr` on success, may write `errno`.
+ */
+enum arr3d_status arr3d_create(struct arr3d **arr, size_t x, size_t y,
+                               size_t z, const struct arr3d_opts *opts);
+
+/** Create unfilled array of a box of selected indices.
+ *
+ * The array holds the selected elements only, so that its size and the cost
+ * of filling and formatting it scale with the selection. Its indices run
+ * over the selected ones, in order; the text format prints the original
+ * indices.
+ *
+ * @param[out] arr pointer to store the handle.
+ * @param box selected indices of each dimension, copied into the handle.
+ * @param opts options of the array, copied into the handle.
+ *
+ * @return `ARR3D_OK`, `ARR3D_ALLOC`, `ARR3D_OVERFLOW` unless `opts->wrap`,
+ * `ARR3D_COMPRESS` if the compression is not built in, or `ARR3D_INVALID`,
+ * also if some step is 0.
+ *
+ * **Effects**: allocates, may read the NUMA topology from sysfs unless
+ * `opts->numa` is `ARR3D_NUMA_NONE`, writes `*arr` on success, may write
+ * `errno`.
+ */
+enum arr3d_status arr3d_create_box(struct arr3d **arr,
+                                   const struct arr3d_range box[3],
+                                   const struct arr3d_opts *opts);
+
+/** Select another box of indices for array, keeping its options.
+ *
+ * Storage of an array filled before is freed, and the array is left
+ * unfilled. The output buffers of the handle, and the line template if the
+ * third dimension still fits it, are kept for the next `arr3d_format`, so
+ * that a handle can serve many boxes in a row.
+ *
+ * @param arr array to change.
+ * @param box selected indices of each dimension, copied into the handle.
+ *
+ * @return `ARR3D_OK`, `ARR3D_OVERFLOW` unless `wrap`, or `ARR3D_INVALID` if
+ * some step is 0, in which case `arr` is unchanged.
+ *
+ * **Effects**: may free, writes `*arr` on success.
+ */
+enum arr3d_status arr3d_set_box(struct arr3d *arr,
+                                const struct arr3d_range box[3]);
+
+/** Compute storage array would allocate when filled.
+ *
+ * All sizes are computed with checked arithmetic, without allocating.
+ * Output buffers and bookkeeping of parallel jobs are not included.
+ *
+ * @param arr array to plan.
+ * @param[out] plan pointer to store the planned allocations as statistics
+ * with zero times, or NULL.
+ * @param[out] bytes pointer to store the total number of bytes, which is the
+ * length of the arena if there is one.
+ *
+ * @return `ARR3D_OK`, or `ARR3D_SIZE` if any size overflows.
+ *
+ * **Effects**: writes `*plan` and `*bytes` on success, may write `errno`.
+ */
+enum arr3d_status arr3d_plan(const struct arr3d *arr, struct arr3d_stats *plan,
+                             size_t *bytes);
+
+/** Allocate and populate storage of array.
+ *
+ * Storage of an array filled before is freed first. The storage is planned
+ * with `arr3d_plan` before anything is allocated, so that impossible sizes
+ * and sizes above `mem_limit` fail at once. On failure, everything
+ * allocated is freed, and the array is left unfilled.
+ *
+ * @param arr array to fill.
+ * @param[out] allocs pointer to store the number of successful allocations,
+ * also on failure.
+ *
+ * @return `ARR3D_OK`, `ARR3D_SIZE`, `ARR3D_MEMORY`, `ARR3D_ALLOC`,
+ * `ARR3D_JOBS`, `ARR3D_OUTPUT_FILE` or `ARR3D_NPY`.
+ *
+ * **Effects**: allocates, writes `*arr`, writes `*allocs`, may create
+ * threads, may resize and map `map_fd`, may write `errno`.
+ */
+enum arr3d_status arr3d_fill(struct arr3d *arr, size_t *allocs);
+
+/** Get allocation statistics of the last population of array.
+ *
+ * The statistics of a failed population are kept as well, and those of an
+ * array that was never filled are 0. The format counters are those of the
+ * last formatting since.
+ *
+ * @param arr array whose statistics to get.
+ * @param[out] stats pointer to store the statistics.
+ *
+ * **Effects**: writes `*stats`.
+ */
+void arr3d_get_stats(const struct arr3d *arr, struct arr3d_stats *stats);
+
+/** Get element of array.
+ *
+ * @param arr filled array.
+ * @param i index into the first layer.
+ * @param j index into the second layer.
+ * @param k index into the third layer.
+ * @param[out] v pointer to store the element.
+ *
+ * @return `ARR3D_OK`, `ARR3D_UNFILLED` or `ARR3D_RANGE`.
+ *
+ * **Effects**: writes `*v` on success.
+ */
+enum arr3d_status arr3d_get(const struct arr3d *arr, size_t i, size_t j,
+                            size_t k, elem *v);
+
+/** Get consecutive elements of a row of array.
+ *
+ * Copies `arr[i][j][k + k_]` for all `k_ < n`, without allocating, so that
+ * sparse lookups and range queries on arrays which are not stored need no
+ * memory beyond `dst`.
+ *
+ * @param arr filled array.
+ * @param i index into the first layer.
+ * @param j index into the second layer.
+ * @param k index into the third layer of the first element.
+ * @param n number of elements to get.
+ * @param[out] dst buffer of at least `n` elements to store them.
+ *
+ * @return `ARR3D_OK`, `ARR3D_UNFILLED` or `ARR3D_RANGE`.
+ *
+ * **Effects**: writes `dst` on success.
+ */
+enum arr3d_status arr3d_get_row(const struct arr3d *arr, size_t i, size_t j,
+                                size_t k, size_t n, elem *dst);
+
+/** Format array and write it to file descriptor.
+ *
+ * If the array was built in `fd` in `format`, nothing is written. Output
+ * buffers are kept in `arr` for later calls. Otherwise the format counters
+ * of the statistics are reset and counted anew.
+ *
+ * @param arr filled array.
+ * @param format output format.
+ * @param fd file descriptor to write to.
+ * @param[out] written pointer to store the number of bytes of output.
+ *
+ * @return `ARR3D_OK`, `ARR3D_UNFILLED`, `ARR3D_JOBS`, `ARR3D_BUFFER`,
+ * `ARR3D_OUTPUT`, `ARR3D_COMPRESS` or `ARR3D_NPY`.
+ *
+ * **Effects**: may allocate, writes to `fd`, may create threads, writes
+ * `*written` on success, may write `errno`.
+ */
+enum arr3d_status arr3d_format(struct arr3d *arr, enum arr3d_format format,
+                               int fd, size_t *written);
+
+/** Destroy array.
+ *
+ * @param arr array to destroy, or NULL.
+ *
+ * **Frees**: `arr`, its storage and its output buffers.
+ */
+void arr3d_destroy(struct arr3d *arr);
+
+#endif